@@ -44,7 +44,8 @@ Func::Func()
       scope(new Block()), argNames(), argVars(), attributes(),
       parentFunc(nullptr), ret(nullptr), yield(nullptr), prefetch(false),
       interAlign(false), resolved(false), cache(), gen(false), promise(nullptr),
-      handle(nullptr), cleanup(nullptr), suspend(nullptr) {
+      promiseReady(nullptr), promiseScheduled(nullptr), handle(nullptr),
+      cleanup(nullptr), suspend(nullptr) {
   if (!this->argNames.empty())
     assert(this->argNames.size() == this->inTypes.size());
 }
@@ -221,8 +222,16 @@ void Func::sawYield(Yield *yield) {
 
   this->yield = yield;
   gen = true;
-  outType = types::GenType::get(outType);
-  outType0 = types::GenType::get(outType0);
+  if (prefetch) {
+    // generator that also suspends after prefetches
+    outType = types::GenType::get(outType->getBaseType(0),
+                                  types::GenType::GenTypeKind::PREFETCH_GEN);
+    outType0 = types::GenType::get(outType0->getBaseType(0),
+                                   types::GenType::GenTypeKind::PREFETCH_GEN);
+  } else {
+    outType = types::GenType::get(outType);
+    outType0 = types::GenType::get(outType0);
+  }
 }
 
 void Func::addAttribute(std::string attr) {
@@ -239,11 +248,19 @@ void Func::addAttribute(std::string attr) {
           getSrcInfo());
 
     prefetch = true;
-    gen = true;
-    outType =
-        types::GenType::get(outType, types::GenType::GenTypeKind::PREFETCH);
-    outType0 =
-        types::GenType::get(outType0, types::GenType::GenTypeKind::PREFETCH);
+    if (yield) {
+      // generator that also suspends after prefetches
+      outType = types::GenType::get(outType->getBaseType(0),
+                                    types::GenType::GenTypeKind::PREFETCH_GEN);
+      outType0 = types::GenType::get(outType0->getBaseType(0),
+                                     types::GenType::GenTypeKind::PREFETCH_GEN);
+    } else {
+      gen = true;
+      outType =
+          types::GenType::get(outType, types::GenType::GenTypeKind::PREFETCH);
+      outType0 =
+          types::GenType::get(outType0, types::GenType::GenTypeKind::PREFETCH);
+    }
   } else if (attr == "inter_align") {
     if (interAlign)
       return;
@@ -321,8 +338,10 @@ std::string Func::getMangledFuncName() {
 }
 
 void Func::resolveTypes() {
-  if ((prefetch || interAlign) && yield)
-    throw exc::SeqException("prefetch statement cannot be used in generator");
+  if (interAlign && yield)
+    throw exc::SeqException(
+        "functions performing inter-sequence alignment cannot be generators",
+        getSrcInfo());
 
   if (external || resolved)
     return;
@@ -341,7 +360,9 @@ void Func::resolveTypes() {
         (yield || (ret && ret->getExpr()))) {
       if (yield) {
         outType = types::GenType::get(
-            yield->getExpr() ? yield->getExpr()->getType() : types::Void);
+            yield->getExpr() ? yield->getExpr()->getType() : types::Void,
+            prefetch ? types::GenType::GenTypeKind::PREFETCH_GEN
+                     : types::GenType::GenTypeKind::NORMAL);
       } else if (ret) {
         outType = ret->getExpr() ? ret->getExpr()->getType() : types::Void;
 
@@ -360,6 +381,11 @@ void Func::resolveTypes() {
      */
     resolved = false;
   }
+
+  // prefetch generators' promises hold a "ready" flag alongside the value
+  if (resolved && prefetch && yield && outType->getBaseType(0)->is(types::Void))
+    throw exc::SeqException("generator performing prefetch must yield values",
+                            getSrcInfo());
 }
 
 void Func::codegen(Module *module) {
@@ -418,11 +444,20 @@ void Func::codegen(Module *module) {
         ConstantPointerNull::get(IntegerType::getInt8PtrTy(context));
 
     if (!outType->getBaseType(0)->is(types::Void)) {
-      promise = makeAlloca(outType->getBaseType(0)->getLLVMType(context),
-                           preambleBlock);
-      promise->setName("promise");
-      Value *promiseRaw =
-          builder.CreateBitCast(promise, IntegerType::getInt8PtrTy(context));
+      types::GenType *genType = outType->asGen();
+      Type *promiseType = genType->getPromiseLLVMType(context);
+      Value *promiseAlloca = makeAlloca(promiseType, preambleBlock);
+      promiseAlloca->setName("promise");
+      if (genType->isPrefetchGen()) {
+        promise = builder.CreateStructGEP(promiseType, promiseAlloca, 0);
+        promiseReady = builder.CreateStructGEP(promiseType, promiseAlloca, 1);
+        promiseScheduled =
+            builder.CreateStructGEP(promiseType, promiseAlloca, 2);
+      } else {
+        promise = promiseAlloca;
+      }
+      Value *promiseRaw = builder.CreateBitCast(
+          promiseAlloca, IntegerType::getInt8PtrTy(context));
       id = builder.CreateCall(
           idFn, {ConstantInt::get(IntegerType::getInt32Ty(context), 0),
                  promiseRaw, nullPtr, nullPtr});
@@ -501,6 +536,11 @@ void Func::codegen(Module *module) {
   builder.SetInsertPoint(entry);
 
   if (gen) {
+    // only a prefetch scheduler makes us suspend after prefetches (see
+    // types::GenType::schedule)
+    if (promiseScheduled)
+      builder.CreateStore(builder.getInt8(0), promiseScheduled);
+
     // make sure the generator is initially suspended:
     codegenYield(nullptr, outType->getBaseType(0), entry);
   }
@@ -546,7 +586,7 @@ void Func::codegen(Module *module) {
 
 void Func::codegenReturn(Value *val, types::Type *type, BasicBlock *&block,
                          bool dryrun) {
-  if (prefetch || interAlign) {
+  if ((prefetch && !yield) || interAlign) {
     codegenYield(val, type, block, false, dryrun);
   } else {
     if (gen) {
@@ -612,6 +652,23 @@ void Func::codegenYield(Value *val, types::Type *type, BasicBlock *&block,
     builder.CreateStore(val, promise);
   }
 
+  // let prefetch schedulers know whether a value is ready
+  if (promiseReady && (empty || type))
+    builder.CreateStore(builder.getInt8(empty ? 0 : 1), promiseReady);
+
+  // prefetch generators resumed outside of a prefetch scheduler just carry
+  // on after a prefetch, so that they behave like regular generators
+  BasicBlock *resume = nullptr;
+  if (empty && promiseScheduled) {
+    BasicBlock *yield = BasicBlock::Create(context, "prefetch_yield",
+                                           block->getParent());
+    resume = BasicBlock::Create(context, "", block->getParent());
+    Value *scheduled = builder.CreateICmpNE(
+        builder.CreateLoad(promiseScheduled), builder.getInt8(0));
+    builder.CreateCondBr(scheduled, yield, resume);
+    builder.SetInsertPoint(yield);
+  }
+
   Function *suspFn = Intrinsic::getDeclaration(module, Intrinsic::coro_suspend);
   Value *tok = ConstantTokenNone::get(context);
   Value *final = ConstantInt::get(IntegerType::getInt1Ty(context),
@@ -622,7 +679,8 @@ void Func::codegenYield(Value *val, types::Type *type, BasicBlock *&block,
    * Can't have anything after the `ret` instruction we just added,
    * so make a new block and return that to the caller.
    */
-  block = BasicBlock::Create(block->getContext(), "", block->getParent());
+  block = resume ? resume
+                 : BasicBlock::Create(context, "", block->getParent());
 
   SwitchInst *inst = builder.CreateSwitch(susp, suspend, 2);
   inst->addCase(ConstantInt::get(IntegerType::getInt8Ty(context), 0), block);
@@ -120,6 +120,14 @@ private:
   /// Storage for this coroutine's promise, or null if none
   llvm::Value *promise;
 
+  /// Storage for whether a prefetch generator's promise holds a new value,
+  /// or null if not a prefetch generator
+  llvm::Value *promiseReady;
+
+  /// Storage for whether a prefetch generator is being run by a prefetch
+  /// scheduler, or null if not a prefetch generator
+  llvm::Value *promiseScheduled;
+
   /// Coroutine handle, or null if none
   llvm::Value *handle;
 
@@ -531,7 +531,8 @@ void TryCatch::codegen0(BasicBlock *&block) {
   types::Type *retType = base->getFuncType()->getBaseType(0);
 
   if (types::GenType *gen = retType->asGen()) {
-    if (gen->fromPrefetch() || gen->fromInterAlign())
+    if ((gen->fromPrefetch() && !gen->isPrefetchGen()) ||
+        gen->fromInterAlign())
       retType = gen->getBaseType(0);
   }
 
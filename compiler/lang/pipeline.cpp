@@ -1,4 +1,6 @@
 #include "lang/seq.h"
+#include "llvm/Support/CommandLine.h"
+#include <algorithm>
 #include <queue>
 #include <utility>
 
@@ -23,9 +25,15 @@ void PipeExpr::resolveTypes() {
 }
 
 // Some useful info for codegen'ing the "drain" step after prefetch transform.
+// A pipeline has one of these for each prefetch or inter-align stage.
 struct DrainState {
-  Value *states; // coroutine states buffer
-  Value *filled; // how many coroutines have been added (alloca'd)
+  unsigned stage; // index of the prefetch or inter-align stage
+  Value *states;  // coroutine states buffer
+  Value *next;    // next coroutine to resume (prefetch only)
+  Value *filled;  // how many coroutines have been added (alloca'd)
+  Value *ctl;     // scheduler width controller (prefetch only)
+  Value *threads; // number of per-thread schedulers (null if only one)
+  bool spawn;     // whether the stage is followed by a parallel pipe
 
   // inter-align-specific fields
   Value *statesTemp;
@@ -41,11 +49,189 @@ struct DrainState {
   std::queue<bool> parallel;
 
   DrainState()
-      : states(nullptr), filled(nullptr), statesTemp(nullptr), pairs(nullptr),
-        pairsTemp(nullptr), bufRef(nullptr), bufQer(nullptr), params(nullptr),
-        hist(nullptr), type(nullptr), stages(), parallel() {}
+      : stage(0), states(nullptr), next(nullptr), filled(nullptr),
+        ctl(nullptr), threads(nullptr), spawn(false), statesTemp(nullptr),
+        pairs(nullptr), pairsTemp(nullptr), bufRef(nullptr), bufQer(nullptr),
+        params(nullptr), hist(nullptr), type(nullptr), stages(), parallel() {}
 };
 
+// Per-thread scheduler counters ("next" and "filled", then the width
+// controller for prefetch) are spaced this many words apart so that
+// different threads' counters lie on different cache lines.
+static const unsigned SCHED_COUNTER_STRIDE = 8;
+
+/*
+ * Prefetch scheduler width
+ *
+ * The number of coroutines a prefetch scheduler keeps in flight is tuned
+ * at runtime by a hill-climbing controller (see seq_sched_ctl_t in the
+ * runtime). Its first two words are read by compiled code: the current
+ * width, and the number of coroutines completed since the controller last
+ * ran, which is invoked every SCHED_TUNE_INTERVAL completions.
+ */
+enum SchedCtlSlot {
+  SCHED_CTL_WIDTH = 0,
+  SCHED_CTL_COMPLETED,
+};
+
+static const unsigned SCHED_TUNE_INTERVAL = 256;
+
+static Function *getSchedInitFunc(Module *module) {
+  LLVMContext &context = module->getContext();
+  auto *f = cast<Function>(module->getOrInsertFunction(
+      "seq_sched_init", Type::getVoidTy(context),
+      seqIntLLVM(context)->getPointerTo(), seqIntLLVM(context),
+      seqIntLLVM(context), seqIntLLVM(context), seqIntLLVM(context)));
+  f->setDoesNotThrow();
+  return f;
+}
+
+static Function *getSchedTuneFunc(Module *module) {
+  LLVMContext &context = module->getContext();
+  auto *f = cast<Function>(module->getOrInsertFunction(
+      "seq_sched_tune", Type::getVoidTy(context),
+      seqIntLLVM(context)->getPointerTo(), seqIntLLVM(context)));
+  f->setDoesNotThrow();
+  return f;
+}
+
+// following defs are from bio/align.seq
+static const unsigned MAX_SEQ_LEN_REF = 256;
+static const unsigned MAX_SEQ_LEN_QER = 128;
+static const unsigned MAX_SEQ_LEN8 = 128;
+static const unsigned MAX_SEQ_LEN16 = 32768;
+static const unsigned HIST_LEN = MAX_SEQ_LEN8 + MAX_SEQ_LEN16 + 32;
+
+// Alignment kernels round batches up to a multiple of their SIMD width, so
+// leave room after each per-thread pair array.
+static const unsigned PAIRS_PADDING = 64;
+
+// Items leaving a parallel generator stage are grouped into batches, each of
+// which is processed by a single task. By default the batch size is tuned at
+// runtime from measured task durations.
+static cl::opt<unsigned>
+    PipelineBatchSize("pipeline-batch",
+                      cl::desc("Number of items per task in parallel "
+                               "pipelines (0 to tune at runtime)"),
+                      cl::init(0));
+
+/*
+ * Pipeline profiling
+ *
+ * With -pipeline-profile, each pipeline gets a global array of counters:
+ * a header (see ProfSlot) followed by items in, items out and cycles for
+ * each stage. Counters are registered with the runtime when the pipeline
+ * first runs, and reported at exit.
+ */
+static cl::opt<bool>
+    PipelineProfile("pipeline-profile",
+                    cl::desc("Count items and cycles for each pipeline "
+                             "stage, and report them at exit"));
+
+enum ProfSlot {
+  PROF_REGISTERED = 0,
+  PROF_DRAIN_CYCLES,
+  PROF_HEADER_SIZE,
+};
+
+enum ProfStageSlot {
+  PROF_IN = 0,
+  PROF_OUT,
+  PROF_CYCLES,
+  PROF_STAGE_SIZE,
+};
+
+static unsigned profStageSlot(unsigned stage, ProfStageSlot slot) {
+  return PROF_HEADER_SIZE + PROF_STAGE_SIZE * stage + slot;
+}
+
+static Value *profCycles(Value *prof, IRBuilder<> &builder) {
+  if (!prof)
+    return nullptr;
+  Module *module = builder.GetInsertBlock()->getModule();
+  Function *rdtsc =
+      Intrinsic::getDeclaration(module, Intrinsic::readcyclecounter);
+  return builder.CreateCall(rdtsc);
+}
+
+static void profAdd(Value *prof, unsigned slot, Value *amount,
+                    IRBuilder<> &builder) {
+  if (!prof)
+    return;
+  Value *ptr = builder.CreateConstGEP1_64(prof, slot);
+  // counters are shared by all threads running the pipeline
+  builder.CreateAtomicRMW(AtomicRMWInst::BinOp::Add, ptr, amount,
+                          AtomicOrdering::Monotonic);
+}
+
+static void profAddCycles(Value *prof, unsigned slot, Value *start,
+                          IRBuilder<> &builder) {
+  if (!prof)
+    return;
+  Value *end = profCycles(prof, builder);
+  profAdd(prof, slot, builder.CreateSub(end, start), builder);
+}
+
+static void profInc(Value *prof, unsigned slot, IRBuilder<> &builder) {
+  if (!prof)
+    return;
+  profAdd(prof, slot, builder.getInt64(1), builder);
+}
+
+#if SEQ_HAS_TAPIR
+static Function *getThreadNumFunc(Module *module) {
+  auto *f = cast<Function>(module->getOrInsertFunction(
+      SEQ_WORK_STEALING ? "seq_ws_worker_id" : "omp_get_thread_num",
+      Type::getInt32Ty(module->getContext())));
+  f->setDoesNotThrow();
+  return f;
+}
+
+static Function *getNumThreadsFunc(Module *module) {
+  auto *f = cast<Function>(module->getOrInsertFunction(
+      SEQ_WORK_STEALING ? "seq_ws_num_workers" : "omp_get_num_threads",
+      Type::getInt32Ty(module->getContext())));
+  f->setDoesNotThrow();
+  return f;
+}
+
+static bool anyParallel(std::queue<bool> parallel) {
+  while (!parallel.empty()) {
+    if (parallel.front())
+      return true;
+    parallel.pop();
+  }
+  return false;
+}
+#endif
+
+// Returns a copy of the given drain state whose buffers are those of the
+// given thread's scheduler.
+static DrainState threadDrainState(DrainState drain, Value *thread,
+                                   IRBuilder<> &builder) {
+  auto slot = [&](Value *buf, uint64_t stride) {
+    return builder.CreateGEP(
+        buf, builder.CreateMul(thread, builder.getInt64(stride)));
+  };
+
+  if (drain.type->fromInterAlign()) {
+    const unsigned W = PipeExpr::SCHED_WIDTH_INTERALIGN;
+    drain.states = slot(drain.states, W);
+    drain.statesTemp = slot(drain.statesTemp, W);
+    drain.pairs = slot(drain.pairs, W + PAIRS_PADDING);
+    drain.pairsTemp = slot(drain.pairsTemp, W + PAIRS_PADDING);
+    drain.bufRef = slot(drain.bufRef, MAX_SEQ_LEN_REF * W);
+    drain.bufQer = slot(drain.bufQer, MAX_SEQ_LEN_QER * W);
+    drain.hist = slot(drain.hist, HIST_LEN);
+  } else {
+    drain.states = slot(drain.states, PipeExpr::SCHED_WIDTH_PREFETCH_MAX);
+    drain.next = slot(drain.next, SCHED_COUNTER_STRIDE);
+    drain.ctl = slot(drain.ctl, SCHED_COUNTER_STRIDE);
+  }
+  drain.filled = slot(drain.filled, SCHED_COUNTER_STRIDE);
+  return drain;
+}
+
 struct seq::PipeExpr::PipelineCodegenState {
   types::Type *type;         // type of current pipeline output
   Value *val;                // value of current pipeline output
@@ -57,13 +243,27 @@ struct seq::PipeExpr::PipelineCodegenState {
   bool inLoop;     // whether we are in a loop (i.e. past some generator stage)
   bool nestedParallel; // whether this pipeline has multiple parallel stages
 
-  DrainState drain; // drain state for prefetch and inter-align optimizations
+  Value *order;   // sequence number of current item (null if not ordered)
+  Value *reorder; // reorder buffer for upcoming "ordered" stage
+
+  Value *prof;        // profiling counters (null if not profiling)
+  unsigned numStages; // total number of stages, for indexing counters
+
+  bool threaded;       // whether this pipeline has "threaded" stages
+  bool threadedInline; // whether "threaded" stages are run inline
+  Value *queue; // queue to the thread of this section's "threaded" stage
+
+  // drain states for prefetch and inter-align optimizations, in pipeline
+  // order; shared with the states used to codegen the drain steps
+  std::vector<DrainState> *drains;
 
   PipelineCodegenState(BasicBlock *block, std::queue<Expr *> stages,
                        std::queue<bool> parallel)
       : type(nullptr), val(nullptr), block(block), stages(std::move(stages)),
         parallel(), inParallel(false), inLoop(false), nestedParallel(false),
-        drain() {
+        order(nullptr), reorder(nullptr), prof(nullptr),
+        numStages(this->stages.size()), threaded(false),
+        threadedInline(false), queue(nullptr), drains(nullptr) {
     int numParallels = 0;
     while (!parallel.empty()) {
       bool p = parallel.front();
@@ -74,13 +274,28 @@ struct seq::PipeExpr::PipelineCodegenState {
     nestedParallel = numParallels > 1;
   }
 
-  PipelineCodegenState getDrainState(Value *val, types::Type *type,
-                                     BasicBlock *block) {
+  PipelineCodegenState getDrainState(const DrainState &drain, Value *val,
+                                     types::Type *type, BasicBlock *block) {
     PipelineCodegenState state(block, drain.stages, drain.parallel);
     state.val = val;
     state.type = type;
+    state.prof = prof;
+    state.numStages = numStages;
+    state.threaded = threaded;
+    state.drains = drains;
     return state;
   }
+
+  // Returns the drain state of the given stage, if its scheduler has
+  // already been created (when the stage is codegen'd again as part of
+  // an earlier stage's drain step).
+  DrainState *findDrain(unsigned stage) {
+    for (auto &drain : *drains) {
+      if (drain.stage == stage)
+        return &drain;
+    }
+    return nullptr;
+  }
 };
 
 // Details of a stage for optimization purposes.
@@ -119,63 +334,194 @@ struct UnpackedStage {
     Func *f = dynamic_cast<Func *>(func->getFunc());
     return f && f->genericName() == name && f->hasAttribute("builtin");
   }
+};
 
-  Expr *repack(Func *f) {
-    assert(func);
-    FuncExpr *newFunc = new FuncExpr(f, func->getTypes());
-    if (!isCall)
-      return newFunc;
+static std::string stageName(Expr *stage) {
+  UnpackedStage unpacked(stage);
+  if (unpacked.func) {
+    if (auto *f = dynamic_cast<Func *>(unpacked.func->getFunc()))
+      return f->genericName();
+  }
+  return "<expr>";
+}
 
-    bool isPartial = false;
-    for (Expr *arg : args) {
-      if (!arg) {
-        isPartial = true;
-        break;
-      }
-    }
+// "ordered" stages restore input order after a parallel stage
+static bool isOrderedStage(Expr *stage) {
+  return UnpackedStage(stage).matches("ordered", 0);
+}
 
-    if (isPartial)
-      return new PartialCallExpr(newFunc, args);
-    else
-      return new CallExpr(newFunc, args);
+static bool anyOrdered(std::queue<Expr *> stages) {
+  while (!stages.empty()) {
+    if (isOrderedStage(stages.front()))
+      return true;
+    stages.pop();
   }
-};
+  return false;
+}
+
+// "threaded" stages run the rest of the pipeline on a separate thread
+static bool isThreadedStage(Expr *stage) {
+  return UnpackedStage(stage).matches("threaded", 0);
+}
+
+static bool anyThreaded(std::queue<Expr *> stages) {
+  while (!stages.empty()) {
+    if (isThreadedStage(stages.front()))
+      return true;
+    stages.pop();
+  }
+  return false;
+}
 
 /*
- * RevComp optimization swaps k-merization loop with revcomp loop so that
- * the latter is only done once.
+ * Stage fusion replaces known pairs of adjacent builtin stages with a single
+ * builtin that does the work of both in one loop, saving a generator
+ * suspend/resume per element. Rules are tried in order over the whole
+ * pipeline, and the pass repeats until no rule applies, so that a fused
+ * stage can itself be fused with its neighbors. Stages are never fused
+ * across a parallel pipe, since that would change which work is spawned.
+ *
+ * Rules:
+ *   - kmers |> revcomp: swaps the k-merization loop with the revcomp loop
+ *     so that the latter is only done once (likewise for kmers_with_pos)
+ *   - kmers |> canonical: keeps rolling windows of both the k-mer and its
+ *     reverse complement
+ *   - split |> kmers, seqs |> kmers, seqs |> split: iterate the inner
+ *     generator directly inside the outer one's loop
  */
-static void applyRevCompOptimization(std::vector<Expr *> &stages,
-                                     std::vector<bool> &parallel) {
-  std::vector<Expr *> stagesNew;
-  std::vector<bool> parallelNew;
-  unsigned i = 0;
-  while (i < stages.size()) {
-    if (i < stages.size() - 1) {
-      UnpackedStage f1(stages[i]);
-      UnpackedStage f2(stages[i + 1]);
-
-      std::string replacement = "";
-      if (f1.matches("kmers", 1) && f2.matches("revcomp"))
-        replacement = "_kmers_revcomp";
-      if (f1.matches("kmers_with_pos", 1) && f2.matches("revcomp_with_pos"))
-        replacement = "_kmers_revcomp_with_pos";
-
-      if (!replacement.empty()) {
-        stagesNew.push_back(f1.repack(Func::getBuiltin(replacement)));
-        stagesNew.back()->resolveTypes();
-        parallelNew.push_back(parallel[i] || parallel[i + 1]);
-        i += 2;
-        continue;
+static cl::opt<bool>
+    DisablePipelineFusion("disable-pipeline-fusion",
+                          cl::desc("Do not fuse adjacent pipeline stages"));
+
+static cl::opt<bool> PipelineFusionReport(
+    "pipeline-fusion-report",
+    cl::desc("Report pipeline stages fused by the compiler"));
+
+// type parameters of a fused stage
+enum FusionTypes {
+  FIRST_TYPES,            // those of the first stage
+  SECOND_TYPES,           // those of the second stage
+  SECOND_TYPES_AND_INPUT, // those of the second stage, then the input type
+};
+
+struct FusionRule {
+  const char *first; // first stage's builtin name
+  int firstArgs;     // number of arguments to first stage (-1 for any)
+  const char *second;
+  int secondArgs;
+  const char *fused; // fused builtin; takes both stages' arguments in order
+  FusionTypes types;
+};
+
+static const FusionRule FUSION_RULES[] = {
+    {"kmers", 1, "revcomp", -1, "_kmers_revcomp", FIRST_TYPES},
+    {"kmers_with_pos", 1, "revcomp_with_pos", -1, "_kmers_revcomp_with_pos",
+     FIRST_TYPES},
+    {"kmers", 1, "canonical", -1, "kmers_canonical", FIRST_TYPES},
+    {"split", 2, "kmers", 1, "_split_kmers", SECOND_TYPES},
+    {"seqs", 0, "kmers", 1, "_seqs_kmers", SECOND_TYPES_AND_INPUT},
+    {"seqs", 0, "kmers_with_pos", 1, "_seqs_kmers_with_pos",
+     SECOND_TYPES_AND_INPUT},
+    {"seqs", 0, "split", 2, "_seqs_split", FIRST_TYPES},
+};
+
+// Returns the type of the items that enter the given stage.
+static types::Type *stageInputType(const std::vector<Expr *> &stages,
+                                   unsigned which) {
+  assert(which > 0);
+  types::Type *type = stages[0]->getType();
+  for (unsigned i = 1; i < which; i++) {
+    if (types::GenType *genType = type->asGen())
+      type = genType->getBaseType(0);
+    ValueExpr arg(type, nullptr);
+    CallExpr call(stages[i], {&arg});
+    type = call.getType();
+  }
+  if (types::GenType *genType = type->asGen())
+    type = genType->getBaseType(0);
+  return type;
+}
+
+static Expr *fuseStages(const FusionRule &rule, UnpackedStage &f1,
+                        UnpackedStage &f2, types::Type *inType) {
+  std::vector<Expr *> args;
+  for (Expr *arg : f1.args)
+    args.push_back(arg);
+  // argument-less stages like "revcomp" may appear as calls, e.g. "revcomp()"
+  if (rule.secondArgs != -1) {
+    for (Expr *arg : f2.args)
+      args.push_back(arg);
+  }
+  // partial calls (with "...") are left alone
+  for (Expr *arg : args) {
+    if (!arg)
+      return nullptr;
+  }
+
+  std::vector<types::Type *> types =
+      (rule.types == FIRST_TYPES ? f1 : f2).func->getTypes();
+  if (rule.types == SECOND_TYPES_AND_INPUT) {
+    // type parameters can't be given for only some of the generics
+    if (types.empty() || !inType)
+      return nullptr;
+    types.push_back(inType);
+  }
+
+  Func *f = Func::getBuiltin(rule.fused);
+  auto *funcExpr = new FuncExpr(f, types);
+  Expr *fused = args.empty() ? (Expr *)funcExpr : new CallExpr(funcExpr, args);
+  fused->resolveTypes();
+  return fused;
+}
+
+static void applyFusion(std::vector<Expr *> &stages,
+                        std::vector<bool> &parallel, const SrcInfo &src) {
+  if (DisablePipelineFusion)
+    return;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (const FusionRule &rule : FUSION_RULES) {
+      std::vector<Expr *> stagesNew;
+      std::vector<bool> parallelNew;
+      unsigned i = 0;
+      while (i < stages.size()) {
+        // never fuse across a parallel pipe ("parallel[i]" is the pipe
+        // between stages i and i + 1)
+        if (i + 1 < stages.size() && !parallel[i]) {
+          UnpackedStage f1(stages[i]);
+          UnpackedStage f2(stages[i + 1]);
+          Expr *fused = nullptr;
+          if (f1.matches(rule.first, rule.firstArgs) &&
+              f2.matches(rule.second, rule.secondArgs)) {
+            types::Type *inType = nullptr;
+            if (rule.types == SECOND_TYPES_AND_INPUT && i > 0)
+              inType = stageInputType(stages, i);
+            fused = fuseStages(rule, f1, f2, inType);
+          }
+
+          if (fused) {
+            if (PipelineFusionReport)
+              errs() << src.file << ":" << src.line << ": fused '"
+                     << rule.first << " |> " << rule.second << "' into '"
+                     << rule.fused << "'\n";
+            stagesNew.push_back(fused);
+            parallelNew.push_back(parallel[i + 1]);
+            i += 2;
+            changed = true;
+            continue;
+          }
+        }
+
+        stagesNew.push_back(stages[i]);
+        parallelNew.push_back(parallel[i]);
+        ++i;
       }
+      stages = stagesNew;
+      parallel = parallelNew;
     }
-
-    stagesNew.push_back(stages[i]);
-    parallelNew.push_back(parallel[i]);
-    ++i;
   }
-  stages = stagesNew;
-  parallel = parallelNew;
 }
 
 // make sure params are globals or literals, since codegen'ing in function entry
@@ -249,16 +595,99 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
 
   Expr *stage = state.stages.front();
   bool parallelize = state.parallel.front();
+  const unsigned stageIdx = state.numStages - state.stages.size();
   state.stages.pop();
   state.parallel.pop();
 
   Value *val0 = state.val;
   types::Type *type0 = state.type;
 
+  if (state.type && isOrderedStage(stage)) {
+    // stages up to this point are already in order if not parallel
+    if (!state.order)
+      return codegenPipe(base, state);
+
+    /*
+     * Ordered stage -- restore input order after parallel section
+     *
+     * Each task deposits its item in the reorder buffer. The task that
+     * deposits the next item in sequence becomes the emitter, and runs
+     * the rest of the pipeline on buffered items in order, until it
+     * reaches one that has not been deposited yet.
+     */
+    auto *putFunc = cast<Function>(module->getOrInsertFunction(
+        "seq_reorder_put", IntegerType::getInt8Ty(context),
+        IntegerType::getInt8PtrTy(context), seqIntLLVM(context),
+        IntegerType::getInt8PtrTy(context)));
+    putFunc->setDoesNotThrow();
+    auto *takeFunc = cast<Function>(module->getOrInsertFunction(
+        "seq_reorder_take", IntegerType::getInt8PtrTy(context),
+        IntegerType::getInt8PtrTy(context)));
+    takeFunc->setDoesNotThrow();
+
+    IRBuilder<> builder(state.block);
+    Value *item = state.reorder; // placeholder for void items
+    if (!state.type->is(types::Void)) {
+      Function *alloc = makeAllocFunc(module, /*atomic=*/false);
+      Type *type = state.type->getLLVMType(context);
+      item = builder.CreateCall(alloc,
+                                builder.getInt64(state.type->size(module)));
+      builder.CreateStore(state.val,
+                          builder.CreateBitCast(item, type->getPointerTo()));
+    }
+    Value *emitter =
+        builder.CreateCall(putFunc, {state.reorder, state.order, item});
+    emitter = builder.CreateICmpNE(emitter, builder.getInt8(0));
+
+    BasicBlock *emit = BasicBlock::Create(context, "emit", func);
+    BasicBlock *body = BasicBlock::Create(context, "body", func);
+    BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+    builder.CreateCondBr(emitter, emit, exit);
+
+    builder.SetInsertPoint(emit);
+    item = builder.CreateCall(takeFunc, state.reorder);
+    Value *empty = builder.CreateIsNull(item);
+    builder.CreateCondBr(empty, exit, body);
+
+    builder.SetInsertPoint(body);
+    if (!state.type->is(types::Void)) {
+      Type *type = state.type->getLLVMType(context);
+      state.val = builder.CreateLoad(
+          builder.CreateBitCast(item, type->getPointerTo()));
+    }
+
+    Value *oldOrder = state.order;
+    Value *oldReorder = state.reorder;
+    state.order = nullptr;
+    state.reorder = nullptr;
+    state.block = body;
+    codegenPipe(base, state);
+    state.order = oldOrder;
+    state.reorder = oldReorder;
+
+    builder.SetInsertPoint(state.block);
+    builder.CreateBr(emit);
+    state.block = exit;
+    return nullptr;
+  }
+
+  if (state.type && isThreadedStage(stage))
+    return codegenThreaded(base, state);
+
+  {
+    IRBuilder<> builder(state.block);
+    profInc(state.prof, profStageSlot(stageIdx, PROF_IN), builder);
+  }
+
   if (!state.val) {
     assert(!state.type);
+    IRBuilder<> builder(state.block);
+    Value *start = profCycles(state.prof, builder);
     state.type = stage->getType();
     state.val = stage->codegen(base, state.block);
+    builder.SetInsertPoint(state.block);
+    profAddCycles(state.prof, profStageSlot(stageIdx, PROF_CYCLES), start,
+                  builder);
   } else {
     assert(state.val && state.type);
     ValueExpr arg(state.type, state.val);
@@ -269,14 +698,20 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
     types::GenType *genType = state.type->asGen();
 
     if (!(genType && (genType->fromPrefetch() || genType->fromInterAlign()))) {
+      IRBuilder<> builder(state.block);
+      Value *start = profCycles(state.prof, builder);
       state.val = call.codegen(base, state.block);
-    } else if (state.drain.states) {
-      throw exc::SeqException("cannot have multiple prefetch or inter-seq "
-                              "alignment functions in single pipeline");
+      builder.SetInsertPoint(state.block);
+      profAddCycles(state.prof, profStageSlot(stageIdx, PROF_CYCLES), start,
+                    builder);
     }
   }
 
   types::GenType *genType = state.type->asGen();
+  if (!genType) {
+    IRBuilder<> builder(state.block);
+    profInc(state.prof, profStageSlot(stageIdx, PROF_OUT), builder);
+  }
   if (genType && genType->fromPrefetch()) {
     /*
      * Function has a prefetch statement
@@ -287,29 +722,127 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
      * this point in the pipeline, as well as a "drain" loop after
      * the pipeline to complete any remaining calls.
      */
-    if (parallelize || state.inParallel)
+    if (state.order || (parallelize && anyOrdered(state.stages)))
+      throw exc::SeqException("ordered stage cannot follow prefetch stage");
+    if (state.threaded)
       throw exc::SeqException(
-          "parallel prefetch transformation currently not supported");
+          "prefetch stage cannot be used in pipeline with threaded stages");
 
+    const unsigned W = PipeExpr::SCHED_WIDTH_PREFETCH_MAX;
     BasicBlock *preamble = base->getPreamble();
     IRBuilder<> builder(preamble);
-    Value *states = makeAlloca(builder.getInt8PtrTy(), preamble,
-                               PipeExpr::SCHED_WIDTH_PREFETCH);
-    Value *next = makeAlloca(seqIntLLVM(context), preamble);
-    Value *filled = makeAlloca(seqIntLLVM(context), preamble);
 
-    builder.SetInsertPoint(entry);
-    builder.CreateStore(zeroLLVM(context), next);
-    builder.CreateStore(zeroLLVM(context), filled);
+    // scheduler already exists if we're codegen'ing an earlier stage's drain
+    DrainState drain;
+    if (DrainState *existing = state.findDrain(stageIdx)) {
+      drain = *existing;
+    } else {
+#if SEQ_HAS_TAPIR
+      if (state.inParallel) {
+        /*
+         * We are inside a task of a parallel pipeline, so each OpenMP
+         * thread gets its own scheduler: a slice of the states buffer
+         * along with its own "next" and "filled" counters. OpenMP tasks
+         * are tied, so a thread can only switch to one of the current
+         * task's descendants while in the middle of a scheduler step;
+         * since no parallel stages can follow this one, those never touch
+         * the thread's scheduler. (With the work-stealing backend, a
+         * worker only runs other tasks while syncing, which a scheduler
+         * step does not do unless the prefetch function itself runs a
+         * parallel pipeline.)
+         */
+        if (parallelize || anyParallel(state.parallel))
+          throw exc::SeqException(
+              "parallel stage cannot follow parallel prefetch stage");
+
+        Function *alloc = makeAllocFunc(module, /*atomic=*/false);
+        Function *allocAtomic = makeAllocFunc(module, /*atomic=*/true);
+        Type *ptrType = builder.getInt8PtrTy();
+
+        const uint64_t ptrSize =
+            module->getDataLayout().getTypeAllocSize(ptrType);
+        builder.SetInsertPoint(entry);
+        Value *threads =
+            builder.CreateZExt(builder.CreateCall(getNumThreadsFunc(module)),
+                               seqIntLLVM(context));
+        Value *statesSize =
+            builder.CreateMul(threads, builder.getInt64(ptrSize * W));
+        Value *countersSize = builder.CreateMul(
+            threads, builder.getInt64(8 * SCHED_COUNTER_STRIDE));
+        Value *states = builder.CreateCall(alloc, statesSize);
+        states = builder.CreateBitCast(states, ptrType->getPointerTo());
+        Value *counters = builder.CreateCall(allocAtomic, countersSize);
+        builder.CreateMemSet(counters, builder.getInt8(0), countersSize, 0);
+        counters = builder.CreateBitCast(
+            counters, seqIntLLVM(context)->getPointerTo());
+
+        drain.states = states;
+        drain.next = counters;
+        drain.filled = builder.CreateGEP(counters, oneLLVM(context));
+        drain.ctl = builder.CreateConstGEP1_64(counters, 2);
+        drain.threads = threads;
+        builder.CreateCall(getSchedInitFunc(module),
+                           {drain.ctl, threads,
+                            builder.getInt64(SCHED_COUNTER_STRIDE),
+                            builder.getInt64(PipeExpr::SCHED_WIDTH_PREFETCH),
+                            builder.getInt64(W)});
+      } else {
+#endif
+        Value *counters =
+            makeAlloca(seqIntLLVM(context), preamble, SCHED_COUNTER_STRIDE);
+        drain.states = makeAlloca(builder.getInt8PtrTy(), preamble, W);
+
+        builder.SetInsertPoint(entry);
+        drain.next = counters;
+        drain.filled = builder.CreateGEP(counters, oneLLVM(context));
+        drain.ctl = builder.CreateConstGEP1_64(counters, 2);
+        builder.CreateStore(zeroLLVM(context), drain.next);
+        builder.CreateStore(zeroLLVM(context), drain.filled);
+        builder.CreateCall(getSchedInitFunc(module),
+                           {drain.ctl, oneLLVM(context),
+                            builder.getInt64(SCHED_COUNTER_STRIDE),
+                            builder.getInt64(PipeExpr::SCHED_WIDTH_PREFETCH),
+                            builder.getInt64(W)});
+#if SEQ_HAS_TAPIR
+      }
+#endif
+
+      // store the current state for the drain step:
+      drain.stage = stageIdx;
+      drain.spawn = SEQ_HAS_TAPIR && parallelize;
+      drain.type = genType;
+      drain.stages = state.stages;
+      drain.parallel = state.parallel;
+      state.drains->push_back(drain);
+    }
 
+    builder.SetInsertPoint(state.block);
+    DrainState threadSlot = drain;
+#if SEQ_HAS_TAPIR
+    if (drain.threads) {
+      Value *tid = builder.CreateZExt(
+          builder.CreateCall(getThreadNumFunc(module)), seqIntLLVM(context));
+      threadSlot = threadDrainState(drain, tid, builder);
+    }
+#endif
+    Value *states = threadSlot.states;
+    Value *next = threadSlot.next;
+    Value *filled = threadSlot.filled;
+    Value *ctl = threadSlot.ctl;
+    Value *width = builder.CreateConstGEP1_64(ctl, SCHED_CTL_WIDTH);
+    Value *completed = builder.CreateConstGEP1_64(ctl, SCHED_CTL_COMPLETED);
+
+    BasicBlock *check = BasicBlock::Create(context, "check", func);
     BasicBlock *notFull = BasicBlock::Create(context, "not_full", func);
     BasicBlock *full = BasicBlock::Create(context, "full", func);
     BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+    builder.CreateBr(check);
 
-    builder.SetInsertPoint(state.block);
+    // the width can shrink below the number of coroutines in flight, in
+    // which case we keep stepping until enough of them have finished
+    builder.SetInsertPoint(check);
     Value *N = builder.CreateLoad(filled);
-    Value *M =
-        ConstantInt::get(seqIntLLVM(context), PipeExpr::SCHED_WIDTH_PREFETCH);
+    Value *M = builder.CreateLoad(width);
     Value *cond = builder.CreateICmpSLT(N, M);
     builder.CreateCondBr(cond, notFull, full);
 
@@ -321,6 +854,8 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
       task = call.codegen(base, notFull);
     }
 
+    // prefetch generators only suspend after prefetches once scheduled
+    genType->schedule(task, notFull);
     builder.SetInsertPoint(notFull);
     Value *slot = builder.CreateGEP(states, N);
     builder.CreateStore(task, slot);
@@ -331,6 +866,8 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
     BasicBlock *full0 = full;
     builder.SetInsertPoint(full);
     Value *nextVal = builder.CreateLoad(next);
+    nextVal = builder.CreateSelect(builder.CreateICmpSLT(nextVal, N), nextVal,
+                                   zeroLLVM(context));
     slot = builder.CreateGEP(states, nextVal);
     Value *gen = builder.CreateLoad(slot);
 
@@ -349,38 +886,66 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
     builder.SetInsertPoint(full);
     builder.CreateCondBr(done, genDone, genNotDone);
 
-    state.type = genType->getBaseType(0);
-    state.val =
-        state.type->is(types::Void) ? nullptr : genType->promise(gen, genDone);
-
-    // store the current state for the drain step:
-    state.drain.states = states;
-    state.drain.filled = filled;
-    state.drain.type = genType;
-    state.drain.stages = state.stages;
-    state.drain.parallel = state.parallel;
-
-    state.block = genDone;
-    codegenPipe(base, state);
-    genDone = state.block;
-    genType->destroy(gen, genDone);
-
-    {
-      ValueExpr arg(type0, val0);
-      CallExpr call(stage, {&arg});
-      call.setTryCatch(tc);
-      task = call.codegen(base, genDone);
+    BasicBlock *advance = genNotDone;
+    if (genType->isPrefetchGen()) {
+      /*
+       * Prefetching generator: each value it yields is sent through the
+       * remainder of the pipeline as soon as it is ready, after which the
+       * generator stays in its slot and we move on to the next one. The
+       * slot is only refilled once the generator is finished.
+       */
+      Value *ready = genType->ready(gen, genNotDone);
+      BasicBlock *genReady = BasicBlock::Create(context, "ready", func);
+      advance = BasicBlock::Create(context, "advance", func);
+      builder.SetInsertPoint(genNotDone);
+      builder.CreateCondBr(ready, genReady, advance);
+
+      state.type = genType->getBaseType(0);
+      state.val = genType->promise(gen, genReady);
+      state.block = genReady;
+      if (drain.spawn)
+        codegenSpawn(base, state);
+      else
+        codegenPipe(base, state);
+      genReady = state.block;
+      builder.SetInsertPoint(genReady);
+      builder.CreateBr(advance);
+    } else {
+      state.type = genType->getBaseType(0);
+      state.val = state.type->is(types::Void) ? nullptr
+                                              : genType->promise(gen, genDone);
+      state.block = genDone;
+      if (drain.spawn)
+        codegenSpawn(base, state);
+      else
+        codegenPipe(base, state);
+      genDone = state.block;
     }
+    genType->destroy(gen, genDone);
 
+    // move the last coroutine into the finished one's slot, then report
+    // the completion to the width controller
     builder.SetInsertPoint(genDone);
-    builder.CreateStore(task, slot);
-    builder.CreateBr(exit);
-
-    builder.SetInsertPoint(genNotDone);
+    Value *last = builder.CreateSub(N, oneLLVM(context));
+    builder.CreateStore(builder.CreateLoad(builder.CreateGEP(states, last)),
+                        slot);
+    builder.CreateStore(last, filled);
+    builder.CreateStore(nextVal, next);
+    Value *count = builder.CreateAdd(builder.CreateLoad(completed),
+                                     oneLLVM(context));
+    builder.CreateStore(count, completed);
+    BasicBlock *tune = BasicBlock::Create(context, "tune", func);
+    builder.CreateCondBr(
+        builder.CreateICmpSGE(count, builder.getInt64(SCHED_TUNE_INTERVAL)),
+        tune, check);
+
+    builder.SetInsertPoint(tune);
+    builder.CreateCall(getSchedTuneFunc(module),
+                       {ctl, builder.getInt64(W)});
+    builder.CreateBr(check);
+
+    builder.SetInsertPoint(advance);
     nextVal = builder.CreateAdd(nextVal, oneLLVM(context));
-    nextVal = builder.CreateAnd(
-        nextVal, ConstantInt::get(seqIntLLVM(context),
-                                  PipeExpr::SCHED_WIDTH_PREFETCH - 1));
     builder.CreateStore(nextVal, next);
     builder.CreateBr(full0);
 
@@ -395,9 +960,12 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
      * scores back to the coroutines when finished. Dynamic scheduling
      * of coroutines is very similar to prefetch's.
      */
-    // we unparallelize inter-seq alignment pipelines (see below)
-    assert(!parallelize);
-    assert(!state.inParallel);
+    if (state.order)
+      throw exc::SeqException(
+          "ordered stage cannot follow inter-seq alignment stage");
+    if (state.threaded)
+      throw exc::SeqException("inter-seq alignment stage cannot be used in "
+                              "pipeline with threaded stages");
 
     BasicBlock *notFull = BasicBlock::Create(context, "not_full", func);
     BasicBlock *notFull0 = notFull;
@@ -413,85 +981,143 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
       task = call.codegen(base, notFull);
     }
 
-    // following defs are from bio/align.seq
-    const int MAX_SEQ_LEN_REF = 256;
-    const int MAX_SEQ_LEN_QER = 128;
-    const int MAX_SEQ_LEN8 = 128;
-    const int MAX_SEQ_LEN16 = 32768;
-    types::RecordType *pairType = PipeExpr::getInterAlignSeqPairType();
     Func *queueFunc = Func::getBuiltin("_interaln_queue");
     Func *flushFunc = Func::getBuiltin("_interaln_flush");
-
     Function *queue = queueFunc->getFunc(module);
     Function *flush = flushFunc->getFunc(module);
-    Function *alloc = makeAllocFunc(module, /*atomic=*/false);
-    Function *allocAtomic = makeAllocFunc(module, /*atomic=*/true);
+    const unsigned W = PipeExpr::SCHED_WIDTH_INTERALIGN;
 
-    BasicBlock *preamble = base->getPreamble();
-    // construct parameters
-    types::GenType::InterAlignParams paramExprs = genType->getAlignParams();
-    Value *params =
-        PipeExpr::validateAndCodegenInterAlignParams(paramExprs, base, entry);
+    // scheduler already exists if we're codegen'ing an earlier stage's drain
+    DrainState drain;
+    if (DrainState *existing = state.findDrain(stageIdx)) {
+      drain = *existing;
+    } else {
+      types::RecordType *pairType = PipeExpr::getInterAlignSeqPairType();
+      Function *alloc = makeAllocFunc(module, /*atomic=*/false);
+      Function *allocAtomic = makeAllocFunc(module, /*atomic=*/true);
+
+      BasicBlock *preamble = base->getPreamble();
+      // construct parameters
+      types::GenType::InterAlignParams paramExprs = genType->getAlignParams();
+      Value *params =
+          PipeExpr::validateAndCodegenInterAlignParams(paramExprs, base, entry);
+
+      // buffers are allocated once per function call, unless we have one
+      // set per thread, in which case they are allocated when the pipeline
+      // starts
+      BasicBlock *allocBlock = preamble;
+      Value *threads = nullptr;
 
-    IRBuilder<> builder(preamble);
-    const unsigned W = PipeExpr::SCHED_WIDTH_INTERALIGN;
-    Value *statesSize = builder.getInt64(genType->size(module) * W);
-    Value *bufRefSize = builder.getInt64(MAX_SEQ_LEN_REF * W);
-    Value *bufQerSize = builder.getInt64(MAX_SEQ_LEN_QER * W);
-    Value *pairsSize = builder.getInt64(pairType->size(module) * W);
-    Value *histSize = builder.getInt64((MAX_SEQ_LEN8 + MAX_SEQ_LEN16 + 32) * 4);
-    Value *states = builder.CreateCall(alloc, statesSize);
-    states = builder.CreateBitCast(
-        states, genType->getLLVMType(context)->getPointerTo());
-    Value *statesTemp = builder.CreateCall(alloc, statesSize);
-    statesTemp = builder.CreateBitCast(
-        statesTemp, genType->getLLVMType(context)->getPointerTo());
-    Value *bufRef = builder.CreateCall(allocAtomic, bufRefSize);
-    Value *bufQer = builder.CreateCall(allocAtomic, bufQerSize);
-    Value *pairs = builder.CreateCall(allocAtomic, pairsSize);
-    pairs = builder.CreateBitCast(
-        pairs, pairType->getLLVMType(context)->getPointerTo());
-    Value *pairsTemp = builder.CreateCall(allocAtomic, pairsSize);
-    pairsTemp = builder.CreateBitCast(
-        pairsTemp, pairType->getLLVMType(context)->getPointerTo());
-    Value *hist = builder.CreateCall(allocAtomic, histSize);
-    hist = builder.CreateBitCast(hist, builder.getInt32Ty()->getPointerTo());
-    Value *filled = makeAlloca(seqIntLLVM(context), preamble);
-
-    builder.SetInsertPoint(entry);
-    builder.CreateStore(zeroLLVM(context), filled);
+#if SEQ_HAS_TAPIR
+      if (state.inParallel) {
+        /*
+         * We are inside a task of a parallel pipeline, so each OpenMP
+         * thread batches its own alignments in its own set of buffers
+         * (see prefetch above); the alignment kernels process a batch on
+         * the calling thread.
+         */
+        if (parallelize || anyParallel(state.parallel))
+          throw exc::SeqException("parallel stage cannot follow parallel "
+                                  "inter-seq alignment stage");
+
+        IRBuilder<> builder(entry);
+        threads =
+            builder.CreateZExt(builder.CreateCall(getNumThreadsFunc(module)),
+                               seqIntLLVM(context));
+        allocBlock = entry;
+      }
+#endif
 
-    builder.SetInsertPoint(state.block);
-    Value *N = builder.CreateLoad(filled);
+      IRBuilder<> builder(allocBlock);
+      Value *numSlots = threads ? threads : builder.getInt64(1);
+      auto slotsSize = [&](uint64_t size) {
+        return builder.CreateMul(numSlots, builder.getInt64(size));
+      };
+
+      Value *statesSize = slotsSize(genType->size(module) * W);
+      Value *bufRefSize = slotsSize(MAX_SEQ_LEN_REF * W);
+      Value *bufQerSize = slotsSize(MAX_SEQ_LEN_QER * W);
+      Value *pairsSize =
+          slotsSize(pairType->size(module) * (W + PAIRS_PADDING));
+      Value *histSize = slotsSize(HIST_LEN * 4);
+      Value *states = builder.CreateCall(alloc, statesSize);
+      states = builder.CreateBitCast(
+          states, genType->getLLVMType(context)->getPointerTo());
+      Value *statesTemp = builder.CreateCall(alloc, statesSize);
+      statesTemp = builder.CreateBitCast(
+          statesTemp, genType->getLLVMType(context)->getPointerTo());
+      Value *bufRef = builder.CreateCall(allocAtomic, bufRefSize);
+      Value *bufQer = builder.CreateCall(allocAtomic, bufQerSize);
+      Value *pairs = builder.CreateCall(allocAtomic, pairsSize);
+      pairs = builder.CreateBitCast(
+          pairs, pairType->getLLVMType(context)->getPointerTo());
+      Value *pairsTemp = builder.CreateCall(allocAtomic, pairsSize);
+      pairsTemp = builder.CreateBitCast(
+          pairsTemp, pairType->getLLVMType(context)->getPointerTo());
+      Value *hist = builder.CreateCall(allocAtomic, histSize);
+      hist = builder.CreateBitCast(hist, builder.getInt32Ty()->getPointerTo());
+      Value *filled = nullptr;
+
+      if (threads) {
+        Value *countersSize = slotsSize(8 * SCHED_COUNTER_STRIDE);
+        filled = builder.CreateCall(allocAtomic, countersSize);
+        builder.CreateMemSet(filled, builder.getInt8(0), countersSize, 0);
+        filled =
+            builder.CreateBitCast(filled, seqIntLLVM(context)->getPointerTo());
+      } else {
+        filled = makeAlloca(seqIntLLVM(context), preamble);
+        builder.SetInsertPoint(entry);
+        builder.CreateStore(zeroLLVM(context), filled);
+      }
+
+      // store the current state for the drain step:
+      drain.stage = stageIdx;
+      drain.states = states;
+      drain.filled = filled;
+      drain.threads = threads;
+      drain.statesTemp = statesTemp;
+      drain.pairs = pairs;
+      drain.pairsTemp = pairsTemp;
+      drain.bufRef = bufRef;
+      drain.bufQer = bufQer;
+      drain.params = params;
+      drain.hist = hist;
+      drain.type = genType;
+      drain.stages = state.stages;
+      drain.parallel = state.parallel;
+      state.drains->push_back(drain);
+    }
+
+    IRBuilder<> builder(state.block);
+    DrainState threadSlot = drain;
+#if SEQ_HAS_TAPIR
+    if (drain.threads) {
+      Value *tid = builder.CreateZExt(
+          builder.CreateCall(getThreadNumFunc(module)), seqIntLLVM(context));
+      threadSlot = threadDrainState(drain, tid, builder);
+    }
+#endif
+    Value *params = drain.params;
+    Value *N = builder.CreateLoad(threadSlot.filled);
     Value *M = ConstantInt::get(seqIntLLVM(context), W);
     Value *cond = builder.CreateICmpSLT(N, M);
     builder.CreateCondBr(cond, notFull0, full);
 
     builder.SetInsertPoint(full);
-    N = builder.CreateCall(flush, {pairs, bufRef, bufQer, states, N, params,
-                                   hist, pairsTemp, statesTemp});
-    builder.CreateStore(N, filled);
+    N = builder.CreateCall(
+        flush, {threadSlot.pairs, threadSlot.bufRef, threadSlot.bufQer,
+                threadSlot.states, N, params, threadSlot.hist,
+                threadSlot.pairsTemp, threadSlot.statesTemp});
+    builder.CreateStore(N, threadSlot.filled);
     cond = builder.CreateICmpSLT(N, M);
     builder.CreateCondBr(cond, notFull0, full); // keep flushing while full
 
-    // store the current state for the drain step:
-    state.drain.states = states;
-    state.drain.filled = filled;
-    state.drain.statesTemp = statesTemp;
-    state.drain.pairs = pairs;
-    state.drain.pairsTemp = pairsTemp;
-    state.drain.bufRef = bufRef;
-    state.drain.bufQer = bufQer;
-    state.drain.params = params;
-    state.drain.hist = hist;
-    state.drain.type = genType;
-    state.drain.stages = state.stages;
-    state.drain.parallel = state.parallel;
-
     builder.SetInsertPoint(notFull);
-    N = builder.CreateLoad(filled);
-    N = builder.CreateCall(queue, {task, pairs, bufRef, bufQer, states, N});
-    builder.CreateStore(N, filled);
+    N = builder.CreateLoad(threadSlot.filled);
+    N = builder.CreateCall(
+        queue, {task, threadSlot.pairs, threadSlot.bufRef, threadSlot.bufQer,
+                threadSlot.states, N});
+    builder.CreateStore(N, threadSlot.filled);
     builder.CreateBr(exit);
     state.block = exit;
     return nullptr;
@@ -500,12 +1126,16 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
      * Plain generator -- create implicit for-loop
      */
     Value *gen = state.val;
+    BasicBlock *begin = state.block;
     IRBuilder<> builder(state.block);
 
     BasicBlock *loop = BasicBlock::Create(context, "pipe", func);
     BasicBlock *loop0 = loop;
     builder.CreateBr(loop);
 
+    builder.SetInsertPoint(loop);
+    Value *start = profCycles(state.prof, builder);
+
     if (tc) {
       BasicBlock *normal = BasicBlock::Create(context, "normal", func);
       BasicBlock *unwind = tc->getExceptionBlock();
@@ -518,6 +1148,8 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
     Value *cond = genType->done(gen, loop);
     BasicBlock *body = BasicBlock::Create(context, "body", func);
     builder.SetInsertPoint(loop);
+    profAddCycles(state.prof, profStageSlot(stageIdx, PROF_CYCLES), start,
+                  builder);
     BranchInst *branch =
         builder.CreateCondBr(cond, body, body); // we set true-branch below
 
@@ -526,9 +1158,38 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
     state.val = state.type->is(types::Void)
                     ? nullptr
                     : genType->promise(gen, state.block);
+    builder.SetInsertPoint(state.block);
+    profInc(state.prof, profStageSlot(stageIdx, PROF_OUT), builder);
+
+    Value *oldOrder = state.order;
+    Value *oldReorder = state.reorder;
 
 #if SEQ_HAS_TAPIR
+    // batch state lives in the enclosing function's frame, so only the
+    // outermost parallel generator can batch
+    if (parallelize && !state.inParallel && PipelineBatchSize != 1) {
+      BasicBlock *done = BasicBlock::Create(context, "done", func);
+      branch->setSuccessor(0, done);
+
+      bool oldInLoop = state.inLoop;
+      state.inLoop = true;
+      BasicBlock *cleanup = codegenBatch(base, state, begin, loop0, done);
+      state.inLoop = oldInLoop;
+      state.order = oldOrder;
+      state.reorder = oldReorder;
+
+      genType->destroy(gen, cleanup);
+      BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+      builder.SetInsertPoint(cleanup);
+      builder.CreateBr(exit);
+      state.block = exit;
+      return nullptr;
+    }
+
     if (parallelize) {
+      if (anyOrdered(state.stages))
+        codegenOrderTag(base, state);
+
       BasicBlock *unwind = tc ? tc->getExceptionBlock() : nullptr;
       BasicBlock *detach = BasicBlock::Create(context, "detach", func);
       builder.SetInsertPoint(state.block);
@@ -547,10 +1208,12 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
     bool oldInLoop = state.inLoop;
     bool oldInParallel = state.inParallel;
     state.inLoop = true;
-    state.inParallel = parallelize;
+    state.inParallel = oldInParallel || parallelize;
     codegenPipe(base, state);
     state.inLoop = oldInLoop;
     state.inParallel = oldInParallel;
+    state.order = oldOrder;
+    state.reorder = oldReorder;
 
     builder.SetInsertPoint(state.block);
 
@@ -580,69 +1243,781 @@ Value *PipeExpr::codegenPipe(BaseFunc *base,
         throw exc::SeqException(
             "parallel pipeline stage is not preceded by generator stage");
 
-      BasicBlock *unwind = tc ? tc->getExceptionBlock() : nullptr;
-      BasicBlock *detach = BasicBlock::Create(context, "detach", func);
-      BasicBlock *cont = BasicBlock::Create(context, "continue", func);
+      codegenSpawn(base, state);
+      return nullptr;
+    }
+#endif /* SEQ_HAS_TAPIR */
 
-      IRBuilder<> builder(state.block);
-      if (unwind)
-        builder.CreateDetach(detach, cont, unwind, syncReg);
-      else
-        builder.CreateDetach(detach, cont, syncReg);
+    return codegenPipe(base, state);
+  }
+}
 
-      bool oldInParallel = state.inParallel;
-      state.inParallel = true;
-      state.block = detach;
-      codegenPipe(base, state);
-      state.inParallel = oldInParallel;
+/*
+ * Parallel pipe -- spawn a task that runs the rest of the pipeline on the
+ * current item in "state", then continue in "state.block" once it is
+ * spawned.
+ */
+void PipeExpr::codegenSpawn(BaseFunc *base,
+                            PipeExpr::PipelineCodegenState &state) {
+#if SEQ_HAS_TAPIR
+  LLVMContext &context = state.block->getContext();
+  Function *func = state.block->getParent();
+  TryCatch *tc = getTryCatch();
 
-      builder.SetInsertPoint(state.block);
-      builder.CreateReattach(cont, syncReg);
+  Value *oldOrder = state.order;
+  Value *oldReorder = state.reorder;
+  if (anyOrdered(state.stages))
+    codegenOrderTag(base, state);
+
+  BasicBlock *unwind = tc ? tc->getExceptionBlock() : nullptr;
+  BasicBlock *detach = BasicBlock::Create(context, "detach", func);
+  BasicBlock *cont = BasicBlock::Create(context, "continue", func);
+
+  IRBuilder<> builder(state.block);
+  if (unwind)
+    builder.CreateDetach(detach, cont, unwind, syncReg);
+  else
+    builder.CreateDetach(detach, cont, syncReg);
+
+  bool oldInParallel = state.inParallel;
+  state.inParallel = true;
+  state.block = detach;
+  codegenPipe(base, state);
+  state.inParallel = oldInParallel;
+  state.order = oldOrder;
+  state.reorder = oldReorder;
+
+  builder.SetInsertPoint(state.block);
+  builder.CreateReattach(cont, syncReg);
+
+  state.block = cont;
+#else
+  assert(0);
+#endif
+}
 
-      state.block = cont;
-      return nullptr;
-    }
-#endif /* SEQ_HAS_TAPIR */
+// Tags the item about to enter a parallel section with its sequence number,
+// for use by a subsequent "ordered" stage. Waits if the item is too far ahead
+// of the last one emitted by that stage, to keep the reorder buffer bounded.
+void PipeExpr::codegenOrderTag(BaseFunc *base,
+                               PipeExpr::PipelineCodegenState &state) {
+  if (state.order)
+    throw exc::SeqException(
+        "ordered stage cannot follow nested parallel stages");
+
+  LLVMContext &context = state.block->getContext();
+  Module *module = state.block->getModule();
+
+  auto *newFunc = cast<Function>(module->getOrInsertFunction(
+      "seq_reorder_new", IntegerType::getInt8PtrTy(context),
+      seqIntLLVM(context)));
+  newFunc->setDoesNotThrow();
+  auto *waitFunc = cast<Function>(module->getOrInsertFunction(
+      "seq_reorder_wait", Type::getVoidTy(context),
+      IntegerType::getInt8PtrTy(context), seqIntLLVM(context)));
+  waitFunc->setDoesNotThrow();
+
+  BasicBlock *preamble = base->getPreamble();
+  Value *counter = makeAlloca(seqIntLLVM(context), preamble);
+
+  IRBuilder<> builder(entry);
+  builder.CreateStore(zeroLLVM(context), counter);
+  Value *reorder = builder.CreateCall(
+      newFunc, ConstantInt::get(seqIntLLVM(context),
+                                PipeExpr::REORDER_BUFFER_SIZE));
+
+  builder.SetInsertPoint(state.block);
+  Value *order = builder.CreateLoad(counter);
+  builder.CreateStore(builder.CreateAdd(order, oneLLVM(context)), counter);
+  builder.CreateCall(waitFunc, {reorder, order});
+
+  state.order = order;
+  state.reorder = reorder;
+}
+
+/*
+ * Stage threads -- "threaded" stages run the rest of the pipeline (up to
+ * the next "threaded" stage) in a long-lived task, which receives items
+ * from the preceding section through a bounded single-producer, single-
+ * consumer queue. The task is spawned when the first item arrives, and
+ * runs until the producer closes the queue at the end of its section.
+ *
+ * Queue layout: head (next item to take, written by the consumer), tail
+ * (next free slot, written by the producer), closed and running flags,
+ * the number of threads blocked on the queue, then the slots. Head and
+ * tail are on separate cache lines. A side that finds the queue full or
+ * empty blocks in the runtime until the other side moves the tail or head
+ * (or closes the queue), and the other side only calls into the runtime to
+ * wake it if the waiter count is nonzero.
+ *
+ * Since the consumer only exits once its queue is closed, it must not be
+ * waited on before then: stages ahead of a "threaded" stage must not sync
+ * (e.g. by running a parallel pipeline of their own), as the sync could
+ * wait on, or even run, the consumer task.
+ */
+#if SEQ_HAS_TAPIR
+enum StageQueueField {
+  QUEUE_HEAD = 0,
+  QUEUE_HEAD_PAD,
+  QUEUE_TAIL,
+  QUEUE_TAIL_PAD,
+  QUEUE_CLOSED,
+  QUEUE_RUNNING,
+  QUEUE_WAITERS,
+  QUEUE_SLOTS,
+};
+
+static StructType *getStageQueueType(LLVMContext &context, Type *elemType) {
+  Type *seqInt = seqIntLLVM(context);
+  Type *pad = ArrayType::get(seqInt, 7);
+  return StructType::get(
+      context, {seqInt, pad, seqInt, pad, seqInt, seqInt, seqInt,
+                ArrayType::get(elemType, PipeExpr::STAGE_QUEUE_SIZE)});
+}
+
+static Value *queueField(Value *queue, StageQueueField field,
+                         IRBuilder<> &builder) {
+  return builder.CreateConstInBoundsGEP2_32(nullptr, queue, 0, field);
+}
+
+static Value *loadAtomic(Value *ptr, AtomicOrdering order,
+                         IRBuilder<> &builder) {
+  LoadInst *inst = builder.CreateLoad(ptr);
+  inst->setAtomic(order);
+  inst->setAlignment(8);
+  return inst;
+}
+
+static void storeAtomic(Value *val, Value *ptr, AtomicOrdering order,
+                        IRBuilder<> &builder) {
+  StoreInst *inst = builder.CreateStore(val, ptr);
+  inst->setAtomic(order);
+  inst->setAlignment(8);
+}
+
+static Function *getStageWaitFunc(Module *module) {
+  LLVMContext &context = module->getContext();
+  Type *seqIntPtr = seqIntLLVM(context)->getPointerTo();
+  auto *f = cast<Function>(module->getOrInsertFunction(
+      "seq_stage_wait", Type::getVoidTy(context), seqIntPtr, seqIntPtr,
+      seqIntLLVM(context), seqIntPtr));
+  f->setDoesNotThrow();
+  return f;
+}
+
+// Wakes the other side of the queue if it is blocked, after the head, tail
+// or closed flag has been updated. Leaves the builder in a new block.
+static void notifyStageQueue(Value *queue, IRBuilder<> &builder) {
+  LLVMContext &context = builder.getContext();
+  Module *module = builder.GetInsertBlock()->getModule();
+  Function *func = builder.GetInsertBlock()->getParent();
+  auto *notifyFunc = cast<Function>(module->getOrInsertFunction(
+      "seq_stage_notify", Type::getVoidTy(context),
+      seqIntLLVM(context)->getPointerTo()));
+  notifyFunc->setDoesNotThrow();
+
+  // orders the update before reading the waiter count (the waiting side
+  // registers itself before re-checking the queue)
+  builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
+  Value *waitersPtr = queueField(queue, QUEUE_WAITERS, builder);
+  Value *waiters =
+      loadAtomic(waitersPtr, AtomicOrdering::Monotonic, builder);
+  BasicBlock *notify = BasicBlock::Create(context, "notify", func);
+  BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+  builder.CreateCondBr(builder.CreateIsNull(waiters), exit, notify);
+  builder.SetInsertPoint(notify);
+  builder.CreateCall(notifyFunc, waitersPtr);
+  builder.CreateBr(exit);
+  builder.SetInsertPoint(exit);
+}
 
+// Marks the given section's queue (if it was ever created) as closed, so
+// that its consumer exits once it has taken every item.
+static void closeStageQueue(Value *queueVar, IRBuilder<> &builder) {
+  LLVMContext &context = builder.getContext();
+  Function *func = builder.GetInsertBlock()->getParent();
+  BasicBlock *close = BasicBlock::Create(context, "close", func);
+  BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+  Value *queue = builder.CreateLoad(queueVar);
+  builder.CreateCondBr(builder.CreateIsNull(queue), exit, close);
+  builder.SetInsertPoint(close);
+  storeAtomic(oneLLVM(context), queueField(queue, QUEUE_CLOSED, builder),
+              AtomicOrdering::Release, builder);
+  notifyStageQueue(queue, builder);
+  builder.CreateBr(exit);
+  builder.SetInsertPoint(exit);
+}
+#endif
+
+Value *PipeExpr::codegenThreaded(BaseFunc *base,
+                                 PipeExpr::PipelineCodegenState &state) {
+#if SEQ_HAS_TAPIR
+  // stage threads are only started from the pipeline's own code
+  if (state.threadedInline)
     return codegenPipe(base, state);
+
+  if (!state.inLoop)
+    throw exc::SeqException(
+        "threaded pipeline stage is not preceded by generator stage");
+  assert(!state.queue);
+
+  LLVMContext &context = state.block->getContext();
+  Module *module = state.block->getModule();
+  Function *func = state.block->getParent();
+  TryCatch *tc = getTryCatch();
+
+  types::Type *type = state.type;
+  const bool isVoid = type->is(types::Void);
+  Type *elemType =
+      isVoid ? IntegerType::getInt8Ty(context) : type->getLLVMType(context);
+  StructType *queueType = getStageQueueType(context, elemType);
+  Value *mask =
+      ConstantInt::get(seqIntLLVM(context), PipeExpr::STAGE_QUEUE_SIZE - 1);
+  Value *size =
+      ConstantInt::get(seqIntLLVM(context), PipeExpr::STAGE_QUEUE_SIZE);
+
+  BasicBlock *preamble = base->getPreamble();
+  Value *queueVar = makeAlloca(queueType->getPointerTo(), preamble);
+  IRBuilder<> builder(entry);
+  builder.CreateStore(ConstantPointerNull::get(queueType->getPointerTo()),
+                      queueVar);
+  state.queue = queueVar;
+
+  BasicBlock *launch = BasicBlock::Create(context, "launch", func);
+  BasicBlock *detach = BasicBlock::Create(context, "detach", func);
+  BasicBlock *check = BasicBlock::Create(context, "check", func);
+  BasicBlock *runInline = BasicBlock::Create(context, "inline", func);
+  BasicBlock *push = BasicBlock::Create(context, "push", func);
+  BasicBlock *wait = BasicBlock::Create(context, "wait", func);
+  BasicBlock *full = BasicBlock::Create(context, "full", func);
+  BasicBlock *store = BasicBlock::Create(context, "store", func);
+  BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+
+  // create the queue and spawn its consumer when the first item arrives
+  builder.SetInsertPoint(state.block);
+  Value *queue = builder.CreateLoad(queueVar);
+  builder.CreateCondBr(builder.CreateIsNull(queue), launch, check);
+
+  builder.SetInsertPoint(launch);
+  Function *alloc = makeAllocFunc(module, /*atomic=*/false);
+  Value *queueSize = ConstantInt::get(
+      seqIntLLVM(context),
+      module->getDataLayout().getTypeAllocSize(queueType));
+  Value *queue1 = builder.CreateCall(alloc, queueSize);
+  builder.CreateMemSet(queue1, builder.getInt8(0), queueSize, 0);
+  queue1 = builder.CreateBitCast(queue1, queueType->getPointerTo());
+  builder.CreateStore(queue1, queueVar);
+  BasicBlock *unwind = tc ? tc->getExceptionBlock() : nullptr;
+  if (unwind)
+    builder.CreateDetach(detach, check, unwind, syncReg);
+  else
+    builder.CreateDetach(detach, check, syncReg);
+
+  builder.SetInsertPoint(check);
+  queue = builder.CreateLoad(queueVar);
+  Value *running = loadAtomic(queueField(queue, QUEUE_RUNNING, builder),
+                              AtomicOrdering::Acquire, builder);
+  builder.CreateCondBr(builder.CreateIsNull(running), runInline, push);
+
+  /*
+   * Until the consumer has started, items are processed inline, so that
+   * the pipeline makes progress even if no thread is free to run it.
+   * Since nothing is queued before then, items are still processed in
+   * order and one at a time.
+   */
+  {
+    PipeExpr::PipelineCodegenState inlineState = state;
+    inlineState.threadedInline = true;
+    inlineState.block = runInline;
+    codegenPipe(base, inlineState);
+    builder.SetInsertPoint(inlineState.block);
+    builder.CreateBr(exit);
+  }
+
+  builder.SetInsertPoint(push);
+  Value *tail = loadAtomic(queueField(queue, QUEUE_TAIL, builder),
+                           AtomicOrdering::Monotonic, builder);
+  builder.CreateBr(wait);
+
+  builder.SetInsertPoint(wait);
+  Value *head = loadAtomic(queueField(queue, QUEUE_HEAD, builder),
+                           AtomicOrdering::Acquire, builder);
+  Value *isFull = builder.CreateICmpSGE(builder.CreateSub(tail, head), size);
+  builder.CreateCondBr(isFull, full, store);
+
+  // block until the consumer takes an item
+  builder.SetInsertPoint(full);
+  builder.CreateCall(getStageWaitFunc(module),
+                     {queueField(queue, QUEUE_WAITERS, builder),
+                      queueField(queue, QUEUE_HEAD, builder), head,
+                      ConstantPointerNull::get(
+                          seqIntLLVM(context)->getPointerTo())});
+  builder.CreateBr(wait);
+
+  builder.SetInsertPoint(store);
+  if (!isVoid) {
+    Value *slot = builder.CreateInBoundsGEP(
+        queue, {zeroLLVM(context), builder.getInt32(QUEUE_SLOTS),
+                builder.CreateAnd(tail, mask)});
+    builder.CreateStore(state.val, slot);
   }
+  storeAtomic(builder.CreateAdd(tail, oneLLVM(context)),
+              queueField(queue, QUEUE_TAIL, builder), AtomicOrdering::Release,
+              builder);
+  notifyStageQueue(queue, builder);
+  builder.CreateBr(exit);
+
+  /*
+   * Consumer task: take items from the queue and run the rest of the
+   * pipeline on each, until the queue is closed and empty. A later
+   * "threaded" stage spawns its own task from here, so this task has its
+   * own sync region, and closes and syncs that stage's queue at the end.
+   */
+  BasicBlock *loop = BasicBlock::Create(context, "consume", func);
+  BasicBlock *empty = BasicBlock::Create(context, "empty", func);
+  BasicBlock *idle = BasicBlock::Create(context, "idle", func);
+  BasicBlock *body = BasicBlock::Create(context, "body", func);
+  BasicBlock *done = BasicBlock::Create(context, "done", func);
+
+  builder.SetInsertPoint(detach);
+  Value *oldSyncReg = syncReg;
+  Function *syncStart =
+      Intrinsic::getDeclaration(module, Intrinsic::syncregion_start);
+  syncReg = builder.CreateCall(syncStart);
+  storeAtomic(oneLLVM(context), queueField(queue1, QUEUE_RUNNING, builder),
+              AtomicOrdering::Release, builder);
+  builder.CreateBr(loop);
+
+  builder.SetInsertPoint(loop);
+  Value *next = loadAtomic(queueField(queue1, QUEUE_HEAD, builder),
+                           AtomicOrdering::Monotonic, builder);
+  Value *avail = loadAtomic(queueField(queue1, QUEUE_TAIL, builder),
+                            AtomicOrdering::Acquire, builder);
+  builder.CreateCondBr(builder.CreateICmpSLT(next, avail), body, empty);
+
+  // check for closing before re-reading the tail, so no item is missed
+  builder.SetInsertPoint(empty);
+  Value *closed = loadAtomic(queueField(queue1, QUEUE_CLOSED, builder),
+                             AtomicOrdering::Acquire, builder);
+  avail = loadAtomic(queueField(queue1, QUEUE_TAIL, builder),
+                     AtomicOrdering::Acquire, builder);
+  BasicBlock *notAvail = BasicBlock::Create(context, "not_avail", func);
+  builder.CreateCondBr(builder.CreateICmpSLT(next, avail), body, notAvail);
+  builder.SetInsertPoint(notAvail);
+  builder.CreateCondBr(builder.CreateIsNull(closed), idle, done);
+
+  // block until the producer adds an item or closes the queue
+  builder.SetInsertPoint(idle);
+  builder.CreateCall(getStageWaitFunc(module),
+                     {queueField(queue1, QUEUE_WAITERS, builder),
+                      queueField(queue1, QUEUE_TAIL, builder), next,
+                      queueField(queue1, QUEUE_CLOSED, builder)});
+  builder.CreateBr(loop);
+
+  PipeExpr::PipelineCodegenState consumerState(body, state.stages,
+                                               state.parallel);
+  builder.SetInsertPoint(body);
+  if (!isVoid) {
+    Value *slot = builder.CreateInBoundsGEP(
+        queue1, {zeroLLVM(context), builder.getInt32(QUEUE_SLOTS),
+                 builder.CreateAnd(next, mask)});
+    consumerState.val = builder.CreateLoad(slot);
+  }
+  // slot can be reused once the item has been read
+  storeAtomic(builder.CreateAdd(next, oneLLVM(context)),
+              queueField(queue1, QUEUE_HEAD, builder), AtomicOrdering::Release,
+              builder);
+  notifyStageQueue(queue1, builder);
+  consumerState.block = builder.GetInsertBlock();
+
+  consumerState.type = type;
+  consumerState.inLoop = true;
+  consumerState.prof = state.prof;
+  consumerState.numStages = state.numStages;
+  consumerState.threaded = true;
+  consumerState.drains = state.drains;
+  codegenPipe(base, consumerState);
+  builder.SetInsertPoint(consumerState.block);
+  builder.CreateBr(loop);
+
+  builder.SetInsertPoint(done);
+  if (consumerState.queue)
+    closeStageQueue(consumerState.queue, builder);
+  BasicBlock *synced = BasicBlock::Create(context, "synced", func);
+  builder.CreateSync(synced, syncReg);
+  builder.SetInsertPoint(synced);
+  builder.CreateReattach(check, oldSyncReg);
+  syncReg = oldSyncReg;
+
+  state.block = exit;
+  return nullptr;
+#else
+  return codegenPipe(base, state);
+#endif
 }
 
-Value *PipeExpr::codegen0(BaseFunc *base, BasicBlock *&block) {
+/*
+ * Task coarsening -- group consecutive items from a parallel generator into
+ * batches, and spawn one task per batch rather than one per item. Tasks run
+ * the rest of the pipeline on each item of their batch in turn. Called with
+ * the generator's current item in "state"; "begin" branches to the generator
+ * loop once per run of the generator (more than once if the generator is
+ * itself nested in a loop), "next" resumes the generator, and "done" is
+ * reached once it is exhausted. Returns the block to continue in after the
+ * last (possibly partial) batch has been spawned.
+ */
+BasicBlock *PipeExpr::codegenBatch(BaseFunc *base,
+                                   PipeExpr::PipelineCodegenState &state,
+                                   BasicBlock *begin, BasicBlock *next,
+                                   BasicBlock *done) {
+#if SEQ_HAS_TAPIR
+  LLVMContext &context = state.block->getContext();
+  Module *module = state.block->getModule();
+  Function *func = state.block->getParent();
+  TryCatch *tc = getTryCatch();
+
+  const bool adaptive = (PipelineBatchSize == 0);
+  const bool ordered = anyOrdered(state.stages);
+  unsigned maxSize = adaptive ? PipeExpr::MAX_BATCH_SIZE : PipelineBatchSize;
+  // an unspawned batch must fit in the reorder buffer, else we could wait
+  // forever on items that are not yet in flight
+  if (ordered && maxSize > PipeExpr::REORDER_BUFFER_SIZE)
+    maxSize = PipeExpr::REORDER_BUFFER_SIZE;
+
+  auto *batchNewFunc = cast<Function>(module->getOrInsertFunction(
+      "seq_batch_new", IntegerType::getInt8PtrTy(context),
+      seqIntLLVM(context)));
+  batchNewFunc->setDoesNotThrow();
+  auto *batchSizeFunc = cast<Function>(module->getOrInsertFunction(
+      "seq_batch_size", seqIntLLVM(context),
+      IntegerType::getInt8PtrTy(context)));
+  batchSizeFunc->setDoesNotThrow();
+  auto *batchTimeFunc = cast<Function>(
+      module->getOrInsertFunction("seq_batch_time", seqIntLLVM(context)));
+  batchTimeFunc->setDoesNotThrow();
+  auto *batchDoneFunc = cast<Function>(module->getOrInsertFunction(
+      "seq_batch_done", Type::getVoidTy(context),
+      IntegerType::getInt8PtrTy(context), seqIntLLVM(context),
+      seqIntLLVM(context)));
+  batchDoneFunc->setDoesNotThrow();
+
+  types::Type *type = state.type;
+  const bool isVoid = type->is(types::Void);
+  Type *llvmType = isVoid ? nullptr : type->getLLVMType(context);
+  Value *elemSize = isVoid ? nullptr
+                           : ConstantInt::get(seqIntLLVM(context),
+                                              type->size(module));
+  Function *alloc = makeAllocFunc(module, /*atomic=*/false);
+
+  BasicBlock *preamble = base->getPreamble();
+  Value *buf =
+      isVoid ? nullptr : makeAlloca(llvmType->getPointerTo(), preamble);
+  Value *count = makeAlloca(seqIntLLVM(context), preamble);
+  Value *limit = makeAlloca(seqIntLLVM(context), preamble);
+  Value *finished = makeAlloca(IntegerType::getInt1Ty(context), preamble);
+  Value *first = ordered ? makeAlloca(seqIntLLVM(context), preamble) : nullptr;
+
+  IRBuilder<> builder(entry);
+  Value *tuner = nullptr;
+  Value *size = nullptr;
+  if (adaptive) {
+    tuner = builder.CreateCall(
+        batchNewFunc, ConstantInt::get(seqIntLLVM(context), maxSize));
+    size = builder.CreateCall(batchSizeFunc, tuner);
+  } else {
+    size = ConstantInt::get(seqIntLLVM(context), maxSize);
+  }
+  builder.CreateStore(size, limit);
+  if (!isVoid) {
+    Value *mem = builder.CreateCall(alloc, builder.CreateMul(size, elemSize));
+    builder.CreateStore(
+        builder.CreateBitCast(mem, llvmType->getPointerTo()), buf);
+  }
+
+  // each run of the generator starts with an empty batch
+  builder.SetInsertPoint(begin->getTerminator());
+  builder.CreateStore(zeroLLVM(context), count);
+  builder.CreateStore(builder.getFalse(), finished);
+
+  // add the current item to the batch, spawning it once full
+  if (ordered)
+    codegenOrderTag(base, state);
+  BasicBlock *spawn = BasicBlock::Create(context, "spawn", func);
+  builder.SetInsertPoint(state.block);
+  Value *n = builder.CreateLoad(count);
+  if (ordered)
+    builder.CreateStore(builder.CreateSub(state.order, n), first);
+  if (!isVoid)
+    builder.CreateStore(state.val,
+                        builder.CreateGEP(builder.CreateLoad(buf), n));
+  n = builder.CreateAdd(n, oneLLVM(context));
+  builder.CreateStore(n, count);
+  Value *full = builder.CreateICmpSGE(n, builder.CreateLoad(limit));
+  builder.CreateCondBr(full, spawn, next);
+
+  // spawn the last partial batch once the generator is done
+  BasicBlock *cleanup = BasicBlock::Create(context, "cleanup", func);
+  builder.SetInsertPoint(done);
+  builder.CreateStore(builder.getTrue(), finished);
+  Value *nonEmpty =
+      builder.CreateICmpSGT(builder.CreateLoad(count), zeroLLVM(context));
+  builder.CreateCondBr(nonEmpty, spawn, cleanup);
+
+  // hand the batch off to a new task, and start a new one
+  builder.SetInsertPoint(spawn);
+  Value *batch = isVoid ? nullptr : builder.CreateLoad(buf);
+  Value *batchLen = builder.CreateLoad(count);
+  Value *batchFirst = ordered ? builder.CreateLoad(first) : nullptr;
+  size = adaptive ? builder.CreateCall(batchSizeFunc, tuner)
+                  : builder.CreateLoad(limit);
+  builder.CreateStore(size, limit);
+  builder.CreateStore(zeroLLVM(context), count);
+  if (!isVoid) {
+    Value *mem = builder.CreateCall(alloc, builder.CreateMul(size, elemSize));
+    builder.CreateStore(
+        builder.CreateBitCast(mem, llvmType->getPointerTo()), buf);
+  }
+
+  BasicBlock *unwind = tc ? tc->getExceptionBlock() : nullptr;
+  BasicBlock *detach = BasicBlock::Create(context, "detach", func);
+  BasicBlock *cont = BasicBlock::Create(context, "continue", func);
+  if (unwind)
+    builder.CreateDetach(detach, cont, unwind, syncReg);
+  else
+    builder.CreateDetach(detach, cont, syncReg);
+
+  // task: run the rest of the pipeline on each item in the batch
+  BasicBlock *loop = BasicBlock::Create(context, "batch", func);
+  BasicBlock *body = BasicBlock::Create(context, "body", func);
+  BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+
+  builder.SetInsertPoint(detach);
+  Value *start = adaptive ? builder.CreateCall(batchTimeFunc) : nullptr;
+  builder.CreateBr(loop);
+
+  builder.SetInsertPoint(loop);
+  PHINode *control = builder.CreatePHI(seqIntLLVM(context), 2);
+  control->addIncoming(zeroLLVM(context), detach);
+  Value *cond = builder.CreateICmpSLT(control, batchLen);
+  builder.CreateCondBr(cond, body, exit);
+
+  builder.SetInsertPoint(body);
+  state.block = body;
+  state.val =
+      isVoid ? nullptr : builder.CreateLoad(builder.CreateGEP(batch, control));
+  if (ordered)
+    state.order = builder.CreateAdd(batchFirst, control);
+
+  bool oldInParallel = state.inParallel;
+  state.inParallel = true;
+  codegenPipe(base, state);
+  state.inParallel = oldInParallel;
+
+  builder.SetInsertPoint(state.block);
+  Value *nextControl = builder.CreateAdd(control, oneLLVM(context));
+  builder.CreateBr(loop);
+  control->addIncoming(nextControl, state.block);
+
+  builder.SetInsertPoint(exit);
+  if (adaptive)
+    builder.CreateCall(batchDoneFunc, {tuner, start, batchLen});
+  builder.CreateReattach(cont, syncReg);
+
+  builder.SetInsertPoint(cont);
+  builder.CreateCondBr(builder.CreateLoad(finished), cleanup, next);
+  return cleanup;
+#else
+  assert(0);
+  return nullptr;
+#endif
+}
+
+BasicBlock *PipeExpr::codegenDrain(BaseFunc *base,
+                                   PipeExpr::PipelineCodegenState &state,
+                                   unsigned which, Value *thread,
+                                   BasicBlock *block) {
   LLVMContext &context = block->getContext();
   Module *module = block->getModule();
   Function *func = block->getParent();
+  TryCatch *tc = getTryCatch();
+  IRBuilder<> builder(block);
 
-  // unparallelize inter-seq alignment pipelines
-  // multithreading will be handled by the alignment kernel
-  bool unparallelize = false;
-  {
-    types::Type *type = nullptr;
-    for (auto *stage : stages) {
-      if (!type) {
-        type = stage->getType();
-      } else {
-        ValueExpr arg(type, nullptr);
-        CallExpr call(
-            stage,
-            {&arg}); // do this through CallExpr for type-parameter deduction
-        type = call.getType();
-      }
+  assert(which < state.drains->size());
+  DrainState drain = (*state.drains)[which];
+  assert(!thread || drain.threads);
+  Value *start = profCycles(state.prof, builder);
+  if (thread)
+    drain = threadDrainState(drain, thread, builder);
+  types::GenType *genType = drain.type;
+  Value *states = drain.states;
+  Value *filled = drain.filled;
 
-      types::GenType *genType = type->asGen();
-      if (genType) {
-        if (genType->fromInterAlign()) {
-          unparallelize = true;
-          break;
-        }
-        type = genType->getBaseType(0);
-      }
+  Value *N = builder.CreateLoad(filled);
+  BasicBlock *loop = BasicBlock::Create(context, "drain", func);
+
+  if (genType->fromPrefetch()) {
+    BasicBlock *loop0 = loop;
+    builder.CreateBr(loop);
+
+    builder.SetInsertPoint(loop);
+    PHINode *control = builder.CreatePHI(seqIntLLVM(context), 3);
+    control->addIncoming(zeroLLVM(context), block);
+    Value *cond = builder.CreateICmpSLT(control, N);
+    BasicBlock *body = BasicBlock::Create(context, "body", func);
+    BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+    builder.CreateCondBr(cond, body, exit);
+
+    builder.SetInsertPoint(body);
+    Value *genSlot = builder.CreateGEP(states, control);
+    Value *gen = builder.CreateLoad(genSlot);
+    Value *done = genType->done(gen, body);
+    Value *next = builder.CreateAdd(control, oneLLVM(context));
+
+    BasicBlock *notDone = BasicBlock::Create(context, "not_done", func);
+    builder.CreateCondBr(done, loop0, notDone);
+    control->addIncoming(next, body);
+
+    BasicBlock *notDoneLoop =
+        BasicBlock::Create(context, "not_done_loop", func);
+    BasicBlock *notDoneLoop0 = notDoneLoop;
+
+    builder.SetInsertPoint(notDone);
+    builder.CreateBr(notDoneLoop);
+
+    if (tc) {
+      BasicBlock *normal = BasicBlock::Create(context, "normal", func);
+      BasicBlock *unwind = tc->getExceptionBlock();
+      genType->resume(gen, notDoneLoop, normal, unwind);
+      notDoneLoop = normal;
+    } else {
+      genType->resume(gen, notDoneLoop, nullptr, nullptr);
+    }
+
+    BasicBlock *finalize = BasicBlock::Create(context, "finalize_gen", func);
+    done = genType->done(gen, notDoneLoop);
+
+    if (genType->isPrefetchGen()) {
+      // send each ready value down the pipeline, then keep stepping
+      BasicBlock *stepped = BasicBlock::Create(context, "stepped", func);
+      builder.SetInsertPoint(notDoneLoop);
+      builder.CreateCondBr(done, finalize, stepped);
+
+      Value *ready = genType->ready(gen, stepped);
+      BasicBlock *genReady = BasicBlock::Create(context, "ready", func);
+      builder.SetInsertPoint(stepped);
+      builder.CreateCondBr(ready, genReady, notDoneLoop0);
+
+      Value *val = genType->promise(gen, genReady);
+      PipeExpr::PipelineCodegenState drainState =
+          state.getDrainState(drain, val, genType->getBaseType(0), genReady);
+      drainState.inParallel = (thread != nullptr);
+      if (drain.spawn)
+        codegenSpawn(base, drainState);
+      else
+        codegenPipe(base, drainState);
+      genReady = drainState.block;
+      builder.SetInsertPoint(genReady);
+      builder.CreateBr(notDoneLoop0);
+    } else {
+      builder.SetInsertPoint(notDoneLoop);
+      builder.CreateCondBr(done, finalize, notDoneLoop0);
+
+      Value *val = genType->promise(gen, finalize);
+      PipeExpr::PipelineCodegenState drainState =
+          state.getDrainState(drain, val, genType->getBaseType(0), finalize);
+      drainState.inParallel = (thread != nullptr);
+      if (drain.spawn)
+        codegenSpawn(base, drainState);
+      else
+        codegenPipe(base, drainState);
+      finalize = drainState.block;
     }
+    genType->destroy(gen, finalize);
+    builder.SetInsertPoint(finalize);
+    builder.CreateBr(loop0);
+    control->addIncoming(next, finalize);
+
+    block = exit;
+  } else if (genType->fromInterAlign()) {
+    Func *flushFunc = Func::getBuiltin("_interaln_flush");
+    Function *flush = flushFunc->getFunc(module);
+
+    Value *cond = builder.CreateICmpSGT(N, builder.getInt64(0));
+    BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+    builder.CreateCondBr(cond, loop, exit);
+
+    builder.SetInsertPoint(loop);
+    N = builder.CreateCall(flush, {drain.pairs, drain.bufRef, drain.bufQer,
+                                   states, N, drain.params, drain.hist,
+                                   drain.pairsTemp, drain.statesTemp});
+    builder.CreateStore(N, filled);
+    cond = builder.CreateICmpSGT(N, builder.getInt64(0));
+    builder.CreateCondBr(cond, loop, exit); // keep flushing while not empty
+
+    block = exit;
+  } else {
+    assert(0);
   }
 
+  builder.SetInsertPoint(block);
+  profAddCycles(state.prof, PROF_DRAIN_CYCLES, start, builder);
+  return block;
+}
+
+// Creates the profiling counters for the given pipeline stages, and
+// registers them with the runtime at the builder's insertion point.
+static Value *makeProfCounters(Module *module, std::vector<Expr *> &stages,
+                               const SrcInfo &src, IRBuilder<> &builder) {
+  LLVMContext &context = module->getContext();
+  Type *strType = builder.getInt8PtrTy();
+  auto makeStr = [&](const std::string &str) -> Constant * {
+    auto *strVar = new GlobalVariable(
+        *module, ArrayType::get(builder.getInt8Ty(), str.length() + 1), true,
+        GlobalValue::PrivateLinkage, ConstantDataArray::getString(context, str),
+        "prof_name");
+    strVar->setAlignment(1);
+    return ConstantExpr::getBitCast(strVar, strType);
+  };
+
+  std::vector<Constant *> names;
+  for (auto *stage : stages)
+    names.push_back(makeStr(stageName(stage)));
+  auto *namesType = ArrayType::get(strType, names.size());
+  auto *namesVar = new GlobalVariable(*module, namesType, true,
+                                      GlobalValue::PrivateLinkage,
+                                      ConstantArray::get(namesType, names),
+                                      "prof_names");
+
+  auto *countersType = ArrayType::get(seqIntLLVM(context),
+                                      PROF_HEADER_SIZE +
+                                          PROF_STAGE_SIZE * stages.size());
+  auto *countersVar = new GlobalVariable(
+      *module, countersType, false, GlobalValue::PrivateLinkage,
+      Constant::getNullValue(countersType), "prof_counters");
+
+  auto *registerFunc = cast<Function>(module->getOrInsertFunction(
+      "seq_prof_register", Type::getVoidTy(context),
+      seqIntLLVM(context)->getPointerTo(), seqIntLLVM(context),
+      strType->getPointerTo(), strType));
+  registerFunc->setDoesNotThrow();
+
+  std::string where = src.file + ":" + std::to_string(src.line);
+  Value *counters = builder.CreateConstInBoundsGEP2_64(countersVar, 0, 0);
+  builder.CreateCall(
+      registerFunc,
+      {counters, ConstantInt::get(seqIntLLVM(context), stages.size()),
+       builder.CreateConstInBoundsGEP2_64(namesVar, 0, 0), makeStr(where)});
+  return counters;
+}
+
+Value *PipeExpr::codegen0(BaseFunc *base, BasicBlock *&block) {
+  LLVMContext &context = block->getContext();
+  Module *module = block->getModule();
+  Function *func = block->getParent();
+
   std::vector<Expr *> stages(this->stages);
   std::vector<bool> parallel(this->parallel);
-  applyRevCompOptimization(stages, parallel);
+  applyFusion(stages, parallel, getSrcInfo());
 
   std::queue<Expr *> queue;
   std::queue<bool> parallelQueue;
@@ -651,7 +2026,7 @@ Value *PipeExpr::codegen0(BaseFunc *base, BasicBlock *&block) {
     queue.push(stage);
 
   for (bool parallelize : parallel)
-    parallelQueue.push(parallelize && !unparallelize);
+    parallelQueue.push(parallelize);
 
   entry = block;
   IRBuilder<> builder(entry);
@@ -667,12 +2042,23 @@ Value *PipeExpr::codegen0(BaseFunc *base, BasicBlock *&block) {
 
   TryCatch *tc = getTryCatch();
   PipeExpr::PipelineCodegenState state(block, queue, parallelQueue);
+  std::vector<DrainState> drains;
+  state.drains = &drains;
+  state.threaded = anyThreaded(queue);
+  const bool anyParallelStage =
+      std::find(parallel.begin(), parallel.end(), true) != parallel.end();
+  if (state.threaded && anyParallelStage)
+    throw exc::SeqException(
+        "threaded stage cannot be used in parallel pipeline");
+  if (PipelineProfile)
+    state.prof = makeProfCounters(module, stages, getSrcInfo(), builder);
 
 #if SEQ_HAS_TAPIR
   // If we have nested parallelism, make sure we use a task group
   // TODO: move this to Tapir? OpenMP backend should detect nested parallelism
   // and use a task group automatically
-  const bool nestedParallel = state.nestedParallel;
+  // (not needed for work-stealing backend, where tasks sync their children)
+  const bool nestedParallel = !SEQ_WORK_STEALING && state.nestedParallel;
   getOrCreateIdentTy(module);
   auto *threadNumFunc = cast<Function>(module->getOrInsertFunction(
       "__kmpc_global_thread_num", builder.getInt32Ty(), getIdentTyPointerTy()));
@@ -705,95 +2091,88 @@ Value *PipeExpr::codegen0(BaseFunc *base, BasicBlock *&block) {
   block = state.block;
   builder.SetInsertPoint(block);
 
-  DrainState &drain = state.drain;
-  if (drain.states) {
-    // drain step:
-    types::GenType *genType = drain.type;
-    Value *states = drain.states;
-    Value *filled = drain.filled;
-    Value *N = builder.CreateLoad(filled);
-    BasicBlock *loop = BasicBlock::Create(context, "drain", func);
-
-    if (genType->fromPrefetch()) {
-      BasicBlock *loop0 = loop;
-      builder.CreateBr(loop);
+#if SEQ_HAS_TAPIR
+  if (state.queue) {
+    closeStageQueue(state.queue, builder);
+    block = builder.GetInsertBlock();
+  }
+#endif
 
-      builder.SetInsertPoint(loop);
-      PHINode *control = builder.CreatePHI(seqIntLLVM(context), 3);
-      control->addIncoming(zeroLLVM(context), block);
-      Value *cond = builder.CreateICmpSLT(control, N);
-      BasicBlock *body = BasicBlock::Create(context, "body", func);
+  /*
+   * Drain schedulers in pipeline order, since draining one runs the
+   * remaining stages and can therefore feed the schedulers of later
+   * stages. Once a scheduler is per-thread, so are all later ones (they
+   * are in the same parallel section), so after the first per-thread
+   * drain no more tasks are spawned.
+   */
+#if SEQ_HAS_TAPIR
+  bool synced = false;
+  bool inTaskGroup = nestedParallel;
+#endif
+  for (unsigned i = 0; i < drains.size(); i++) {
+    if (!drains[i].threads) {
+      block = codegenDrain(base, state, i, nullptr, block);
+      continue;
+    }
+#if SEQ_HAS_TAPIR
+    builder.SetInsertPoint(block);
+    // per-thread schedulers can only be drained once all tasks are done
+    if (inTaskGroup) {
+      builder.CreateCall(endTaskGroupFunc, {ompLoc, gtid});
+      inTaskGroup = false;
+    } else if (!synced) {
       BasicBlock *exit = BasicBlock::Create(context, "exit", func);
-      builder.CreateCondBr(cond, body, exit);
-
-      builder.SetInsertPoint(body);
-      Value *genSlot = builder.CreateGEP(states, control);
-      Value *gen = builder.CreateLoad(genSlot);
-      Value *done = genType->done(gen, body);
-      Value *next = builder.CreateAdd(control, oneLLVM(context));
-
-      BasicBlock *notDone = BasicBlock::Create(context, "not_done", func);
-      builder.CreateCondBr(done, loop0, notDone);
-      control->addIncoming(next, body);
-
-      BasicBlock *notDoneLoop =
-          BasicBlock::Create(context, "not_done_loop", func);
-      BasicBlock *notDoneLoop0 = notDoneLoop;
-
-      builder.SetInsertPoint(notDone);
-      builder.CreateBr(notDoneLoop);
-
-      if (tc) {
-        BasicBlock *normal = BasicBlock::Create(context, "normal", func);
-        BasicBlock *unwind = tc->getExceptionBlock();
-        genType->resume(gen, notDoneLoop, normal, unwind);
-        notDoneLoop = normal;
-      } else {
-        genType->resume(gen, notDoneLoop, nullptr, nullptr);
-      }
-
-      BasicBlock *finalize = BasicBlock::Create(context, "finalize_gen", func);
-      done = genType->done(gen, notDoneLoop);
-      builder.SetInsertPoint(notDoneLoop);
-      builder.CreateCondBr(done, finalize, notDoneLoop0);
+      builder.CreateSync(exit, syncReg);
+      block = exit;
+    }
 
-      Value *val = genType->promise(gen, finalize);
-      PipeExpr::PipelineCodegenState drainState =
-          state.getDrainState(val, genType->getBaseType(0), finalize);
-      codegenPipe(base, drainState);
-      finalize = drainState.block;
-      genType->destroy(gen, finalize);
-      builder.SetInsertPoint(finalize);
-      builder.CreateBr(loop0);
-      control->addIncoming(next, finalize);
+    // drain each thread's scheduler in its own task
+    BasicBlock *loop = BasicBlock::Create(context, "drain_threads", func);
+    BasicBlock *body = BasicBlock::Create(context, "body", func);
+    BasicBlock *detach = BasicBlock::Create(context, "detach", func);
+    BasicBlock *cont = BasicBlock::Create(context, "continue", func);
+    BasicBlock *exit = BasicBlock::Create(context, "exit", func);
 
-      block = exit;
-    } else if (genType->fromInterAlign()) {
-      Func *flushFunc = Func::getBuiltin("_interaln_flush");
-      Function *flush = flushFunc->getFunc(module);
+    builder.SetInsertPoint(block);
+    builder.CreateBr(loop);
 
-      Value *cond = builder.CreateICmpSGT(N, builder.getInt64(0));
-      BasicBlock *exit = BasicBlock::Create(context, "exit", func);
-      builder.CreateCondBr(cond, loop, exit);
+    builder.SetInsertPoint(loop);
+    PHINode *control = builder.CreatePHI(seqIntLLVM(context), 2);
+    control->addIncoming(zeroLLVM(context), block);
+    Value *cond = builder.CreateICmpSLT(control, drains[i].threads);
+    builder.CreateCondBr(cond, body, exit);
+
+    builder.SetInsertPoint(body);
+    BasicBlock *unwind = tc ? tc->getExceptionBlock() : nullptr;
+    if (unwind)
+      builder.CreateDetach(detach, cont, unwind, syncReg);
+    else
+      builder.CreateDetach(detach, cont, syncReg);
 
-      builder.SetInsertPoint(loop);
-      N = builder.CreateCall(flush, {drain.pairs, drain.bufRef, drain.bufQer,
-                                     states, N, drain.params, drain.hist,
-                                     drain.pairsTemp, drain.statesTemp});
-      builder.CreateStore(N, filled);
-      cond = builder.CreateICmpSGT(N, builder.getInt64(0));
-      builder.CreateCondBr(cond, loop, exit); // keep flushing while not empty
+    detach = codegenDrain(base, state, i, control, detach);
+    builder.SetInsertPoint(detach);
+    builder.CreateReattach(cont, syncReg);
 
-      block = exit;
-    } else {
-      assert(0);
-    }
+    builder.SetInsertPoint(cont);
+    Value *next = builder.CreateAdd(control, oneLLVM(context));
+    builder.CreateBr(loop);
+    control->addIncoming(next, cont);
+
+    block = BasicBlock::Create(context, "exit", func);
+    builder.SetInsertPoint(exit);
+    builder.CreateSync(block, syncReg);
+    synced = true;
+#else
+    assert(0);
+#endif
   }
 
 #if SEQ_HAS_TAPIR
   builder.SetInsertPoint(block);
   // create sync
-  if (nestedParallel) {
+  if (synced) {
+    // already synced after drain step
+  } else if (inTaskGroup) {
     builder.CreateCall(endTaskGroupFunc, {ompLoc, gtid});
   } else {
     BasicBlock *exit = BasicBlock::Create(context, "exit", func);
@@ -14,10 +14,24 @@ private:
 
   struct PipelineCodegenState;
   llvm::Value *codegenPipe(BaseFunc *base, PipelineCodegenState &state);
+  llvm::BasicBlock *codegenDrain(BaseFunc *base, PipelineCodegenState &state,
+                                 unsigned which, llvm::Value *thread,
+                                 llvm::BasicBlock *block);
+  void codegenSpawn(BaseFunc *base, PipelineCodegenState &state);
+  void codegenOrderTag(BaseFunc *base, PipelineCodegenState &state);
+  llvm::Value *codegenThreaded(BaseFunc *base, PipelineCodegenState &state);
+  llvm::BasicBlock *codegenBatch(BaseFunc *base, PipelineCodegenState &state,
+                                 llvm::BasicBlock *begin,
+                                 llvm::BasicBlock *next,
+                                 llvm::BasicBlock *done);
 
 public:
-  static const unsigned SCHED_WIDTH_PREFETCH = 16;
+  static const unsigned SCHED_WIDTH_PREFETCH = 16; // initial width
+  static const unsigned SCHED_WIDTH_PREFETCH_MAX = 64;
   static const unsigned SCHED_WIDTH_INTERALIGN = 2048;
+  static const unsigned REORDER_BUFFER_SIZE = 1024;
+  static const unsigned MAX_BATCH_SIZE = 4096;
+  static const unsigned STAGE_QUEUE_SIZE = 1024;
   explicit PipeExpr(std::vector<Expr *> stages,
                     std::vector<bool> parallel = {});
   void setParallel(unsigned which);
@@ -123,7 +123,7 @@ Function *SeqModule::makeCanonicalMainFunc(Function *realMain) {
   builder.SetInsertPoint(exit);
   builder.CreateCall(initFunc);
 
-#if SEQ_HAS_TAPIR
+#if SEQ_HAS_TAPIR && !SEQ_WORK_STEALING
   /*
    * Put the entire program in a parallel+single region
    */
@@ -360,7 +360,10 @@ static void optimizeModule(Module *module) {
   unsigned sizeLevel = 0;
   PassManagerBuilder builder;
 
-#if SEQ_HAS_TAPIR
+#if SEQ_WORK_STEALING
+  static tapir::WorkStealingABI ws;
+  builder.tapirTarget = &ws;
+#elif SEQ_HAS_TAPIR
   static OpenMPABI omp;
   builder.tapirTarget = &omp;
 #endif
@@ -168,6 +168,42 @@ void types::GenType::resume(Value *self, BasicBlock *block, BasicBlock *normal,
     builder.CreateCall(resFn, self);
 }
 
+Value *types::GenType::ready(Value *self, BasicBlock *block) {
+  if (!isPrefetchGen())
+    return ConstantInt::getTrue(block->getContext());
+
+  LLVMContext &context = block->getContext();
+  Value *ptr = promise(self, block, /*returnPtr=*/true);
+  IRBuilder<> builder(block);
+  ptr = builder.CreateBitCast(ptr, getPromiseLLVMType(context)->getPointerTo());
+  Value *ready = builder.CreateLoad(builder.CreateStructGEP(nullptr, ptr, 1));
+  return builder.CreateICmpNE(ready, builder.getInt8(0));
+}
+
+void types::GenType::schedule(Value *self, BasicBlock *block) {
+  if (!isPrefetchGen())
+    return;
+
+  LLVMContext &context = block->getContext();
+  Value *ptr = promise(self, block, /*returnPtr=*/true);
+  IRBuilder<> builder(block);
+  ptr = builder.CreateBitCast(ptr, getPromiseLLVMType(context)->getPointerTo());
+  builder.CreateStore(builder.getInt8(1),
+                      builder.CreateStructGEP(nullptr, ptr, 2));
+}
+
+llvm::Type *types::GenType::getPromiseLLVMType(LLVMContext &context) const {
+  llvm::Type *type = outType->getLLVMType(context);
+  if (kind != GenTypeKind::PREFETCH_GEN)
+    return type;
+  // prefetch generators record whether they last suspended on a yield (1)
+  // or after a prefetch (0), and whether they are being run by a prefetch
+  // scheduler; if not, they do not suspend after prefetches at all, so they
+  // can be resumed like any other generator
+  return StructType::get(type, IntegerType::getInt8Ty(context),
+                         IntegerType::getInt8Ty(context));
+}
+
 Value *types::GenType::promise(Value *self, BasicBlock *block, bool returnPtr) {
   if (outType->is(types::Void))
     return nullptr;
@@ -181,7 +217,7 @@ Value *types::GenType::promise(Value *self, BasicBlock *block, bool returnPtr) {
   Value *aln =
       ConstantInt::get(IntegerType::getInt32Ty(context),
                        block->getModule()->getDataLayout().getPrefTypeAlignment(
-                           outType->getLLVMType(context)));
+                           getPromiseLLVMType(context)));
   Value *from = ConstantInt::get(IntegerType::getInt1Ty(context), 0);
 
   Value *ptr = builder.CreateCall(promFn, {self, aln, from});
@@ -205,7 +241,13 @@ void types::GenType::destroy(Value *self, BasicBlock *block) {
   builder.CreateCall(destFn, self);
 }
 
-bool types::GenType::fromPrefetch() { return kind == GenTypeKind::PREFETCH; }
+bool types::GenType::fromPrefetch() {
+  return kind == GenTypeKind::PREFETCH || kind == GenTypeKind::PREFETCH_GEN;
+}
+
+bool types::GenType::isPrefetchGen() {
+  return kind == GenTypeKind::PREFETCH_GEN;
+}
 
 bool types::GenType::fromInterAlign() {
   return kind == GenTypeKind::INTERALIGN;
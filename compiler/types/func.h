@@ -41,7 +41,7 @@ public:
 // Generator types really represent generator handles in LLVM
 class GenType : public Type {
 public:
-  enum GenTypeKind { NORMAL, PREFETCH, INTERALIGN };
+  enum GenTypeKind { NORMAL, PREFETCH, PREFETCH_GEN, INTERALIGN };
   struct InterAlignParams { // see bio/align.seq for definition
     Expr *a, *b, *ambig, *gapo, *gape, *bandwidth, *zdrop, *end_bonus;
     InterAlignParams()
@@ -65,11 +65,15 @@ public:
   llvm::Value *done(llvm::Value *self, llvm::BasicBlock *block);
   void resume(llvm::Value *self, llvm::BasicBlock *block,
               llvm::BasicBlock *normal, llvm::BasicBlock *unwind);
+  llvm::Value *ready(llvm::Value *self, llvm::BasicBlock *block);
+  void schedule(llvm::Value *self, llvm::BasicBlock *block);
+  llvm::Type *getPromiseLLVMType(llvm::LLVMContext &context) const;
   llvm::Value *promise(llvm::Value *self, llvm::BasicBlock *block,
                        bool returnPtr = false);
   void send(llvm::Value *self, llvm::Value *val, llvm::BasicBlock *block);
   void destroy(llvm::Value *self, llvm::BasicBlock *block);
   bool fromPrefetch();
+  bool isPrefetchGen();
   bool fromInterAlign();
   void setAlignParams(InterAlignParams alnParams);
   InterAlignParams getAlignParams();
@@ -870,12 +870,19 @@ void types::KMer::initOps() {
        {},
        Int,
        [this](Value *self, std::vector<Value *> args, IRBuilder<> &b) {
-         Value *hash = b.CreateZExtOrTrunc(self, seqIntLLVM(b.getContext()));
-         if (getK() > 32) {
-           // make sure bases on both ends are involved in hash:
-           Value *aux = b.CreateLShr(self, 2 * getK() - 64);
-           aux = b.CreateZExtOrTrunc(aux, seqIntLLVM(b.getContext()));
-           hash = b.CreateXor(hash, aux);
+         IntegerType *word = seqIntLLVM(b.getContext());
+         if (getK() <= 32)
+           return b.CreateZExt(self, word);
+
+         // fold in each 64-bit word with a multiply-xorshift step, so that
+         // every base (not just those on the ends) is involved in the hash
+         Value *hash = zeroLLVM(b.getContext());
+         for (unsigned shift = 0; shift < 2 * getK(); shift += 64) {
+           Value *w = b.CreateTrunc(shift ? b.CreateLShr(self, shift) : self,
+                                    word);
+           hash = b.CreateMul(b.CreateXor(hash, w),
+                              ConstantInt::get(word, 0x9e3779b97f4a7c15ull));
+           hash = b.CreateXor(hash, b.CreateLShr(hash, 32));
          }
          return hash;
        },
@@ -193,3 +193,8 @@ public:
 #else
 #define SEQ_HAS_TAPIR 0
 #endif
+
+#if !defined(SEQ_WORK_STEALING) || !SEQ_HAS_TAPIR
+#undef SEQ_WORK_STEALING
+#define SEQ_WORK_STEALING 0
+#endif
@@ -0,0 +1,215 @@
+#include "util/tapir.h"
+
+#if SEQ_WORK_STEALING
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace seq;
+using namespace llvm;
+
+static Function *getSpawnFunc(Module *module) {
+  LLVMContext &context = module->getContext();
+  auto *f = cast<Function>(
+      module->getOrInsertFunction("seq_ws_spawn", Type::getVoidTy(context),
+                                  IntegerType::getInt8PtrTy(context)));
+  f->setDoesNotThrow();
+  return f;
+}
+
+static Function *getSyncFunc(Module *module) {
+  LLVMContext &context = module->getContext();
+  auto *f = cast<Function>(module->getOrInsertFunction(
+      "seq_ws_sync", Type::getVoidTy(context),
+      seqIntLLVM(context)->getPointerTo()));
+  f->setDoesNotThrow();
+  return f;
+}
+
+static Function *getNumWorkersFunc(Module *module) {
+  auto *f = cast<Function>(module->getOrInsertFunction(
+      "seq_ws_num_workers", Type::getInt32Ty(module->getContext())));
+  f->setDoesNotThrow();
+  return f;
+}
+
+/*
+ * A function's frame is a counter of its outstanding spawned tasks. Spawned
+ * tasks always complete before the function returns or unwinds (see
+ * syncOnUnwind), which makes nested parallelism safe without
+ * OpenMP-style task groups, and keeps tasks from outliving the frame.
+ */
+Value *seq::tapir::WorkStealingABI::getOrCreateFrame(
+    Function &F, ValueToValueMapTy &DetachCtxToStackFrame) {
+  if (DetachCtxToStackFrame.count(&F))
+    return DetachCtxToStackFrame[&F];
+
+  LLVMContext &context = F.getContext();
+  BasicBlock &entry = F.getEntryBlock();
+  IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+  Value *frame = builder.CreateAlloca(seqIntLLVM(context), nullptr, "frame");
+  builder.CreateStore(zeroLLVM(context), frame);
+
+  // implicit sync before returning
+  Function *sync = getSyncFunc(F.getParent());
+  for (BasicBlock &block : F) {
+    if (auto *ret = dyn_cast<ReturnInst>(block.getTerminator()))
+      CallInst::Create(sync, frame, "", ret);
+  }
+
+  DetachCtxToStackFrame[&F] = frame;
+  frames[&F] = frame;
+  return frame;
+}
+
+// Adds the implicit sync to exceptions propagating out of the function:
+// before resuming from its landing pads, and for calls that may throw,
+// which are turned into invokes whose landing pad syncs and then resumes.
+static void syncOnUnwind(Function &F, Value *frame) {
+  Module *module = F.getParent();
+  LLVMContext &context = module->getContext();
+  Function *sync = getSyncFunc(module);
+
+  std::vector<CallInst *> calls;
+  for (BasicBlock &block : F) {
+    Instruction *term = block.getTerminator();
+    if (isa<ResumeInst>(term))
+      CallInst::Create(sync, frame, "", term);
+
+    for (Instruction &inst : block) {
+      auto *call = dyn_cast<CallInst>(&inst);
+      if (call && !call->doesNotThrow() && !call->isInlineAsm() &&
+          !isa<IntrinsicInst>(call))
+        calls.push_back(call);
+    }
+  }
+
+  if (calls.empty())
+    return;
+
+  if (!F.hasPersonalityFn())
+    F.setPersonalityFn(makePersonalityFunc(module));
+  BasicBlock *unwind = BasicBlock::Create(context, "ws.unwind", &F);
+  IRBuilder<> builder(unwind);
+  LandingPadInst *pad = builder.CreateLandingPad(
+      StructType::get(IntegerType::getInt8PtrTy(context),
+                      IntegerType::getInt32Ty(context)),
+      0);
+  pad->setCleanup(true);
+  builder.CreateCall(sync, frame);
+  builder.CreateResume(pad);
+
+  for (CallInst *call : calls)
+    changeToInvokeAndSplitBasicBlock(call, unwind);
+}
+
+// Makes "void f.task(i8 *task)", which unpacks the arguments of the given
+// outlined function from the task and calls it.
+static Function *makeTaskFunc(Function *extracted, StructType *taskType) {
+  Module *module = extracted->getParent();
+  LLVMContext &context = module->getContext();
+  auto *funcType = FunctionType::get(Type::getVoidTy(context),
+                                     {IntegerType::getInt8PtrTy(context)},
+                                     /*isVarArg=*/false);
+  Function *func =
+      Function::Create(funcType, GlobalValue::PrivateLinkage,
+                       extracted->getName() + ".task", module);
+  BasicBlock *entry = BasicBlock::Create(context, "entry", func);
+  IRBuilder<> builder(entry);
+  Value *task =
+      builder.CreateBitCast(func->arg_begin(), taskType->getPointerTo());
+  std::vector<Value *> args;
+  // first two fields are the header (see seq_ws_task_t)
+  for (unsigned i = 2; i < taskType->getNumElements(); i++)
+    args.push_back(
+        builder.CreateLoad(builder.CreateStructGEP(taskType, task, i)));
+  builder.CreateCall(extracted, args);
+  builder.CreateRetVoid();
+  return func;
+}
+
+Value *seq::tapir::WorkStealingABI::GetOrCreateWorker8(Function &F) {
+  Instruction *term = F.getEntryBlock().getTerminator();
+  Value *workers =
+      CallInst::Create(getNumWorkersFunc(F.getParent()), "", term);
+  return BinaryOperator::Create(Instruction::Mul, workers,
+                                ConstantInt::get(workers->getType(), 8), "",
+                                term);
+}
+
+void seq::tapir::WorkStealingABI::createSync(
+    SyncInst &sync, ValueToValueMapTy &DetachCtxToStackFrame) {
+  Function &F = *sync.getParent()->getParent();
+  Value *frame = getOrCreateFrame(F, DetachCtxToStackFrame);
+  CallInst::Create(getSyncFunc(F.getParent()), frame, "", &sync);
+  ReplaceInstWithInst(&sync, BranchInst::Create(sync.getSuccessor(0)));
+}
+
+Function *seq::tapir::WorkStealingABI::createDetach(
+    DetachInst &detach, ValueToValueMapTy &DetachCtxToStackFrame,
+    DominatorTree &DT, AssumptionCache &AC) {
+  BasicBlock *detB = detach.getParent();
+  Function &F = *detB->getParent();
+  BasicBlock *spawned = detach.getDetached();
+  BasicBlock *cont = detach.getContinue();
+  Module *module = F.getParent();
+  LLVMContext &context = module->getContext();
+
+  Value *frame = getOrCreateFrame(F, DetachCtxToStackFrame);
+  CallInst *call = nullptr;
+  Function *extracted = extractDetachBodyToFunction(detach, DT, AC, &call);
+  assert(extracted && call && "could not extract detach body to function");
+
+  // Replace the detach with a branch to the continuation; the outlined
+  // detached CFG is left for subsequent DCE.
+  ReplaceInstWithInst(&detach, BranchInst::Create(cont));
+  for (auto it = spawned->begin(); auto *phi = dyn_cast<PHINode>(&*it); ++it)
+    phi->removeIncomingValue(detB);
+
+  // Package the call's arguments into a GC-allocated task, so that captured
+  // values stay alive until the task runs, then spawn the task in its place.
+  std::vector<Type *> types = {IntegerType::getInt8PtrTy(context),
+                               seqIntLLVM(context)->getPointerTo()};
+  for (unsigned i = 0; i < call->getNumArgOperands(); i++)
+    types.push_back(call->getArgOperand(i)->getType());
+  StructType *taskType = StructType::get(context, types);
+  Function *taskFunc = makeTaskFunc(extracted, taskType);
+
+  IRBuilder<> builder(call);
+  Function *alloc = makeAllocFunc(module, /*atomic=*/false);
+  Value *task = builder.CreateCall(
+      alloc, builder.getInt64(
+                 module->getDataLayout().getTypeAllocSize(taskType)));
+  Value *taskTyped = builder.CreateBitCast(task, taskType->getPointerTo());
+  builder.CreateStore(
+      builder.CreateBitCast(taskFunc, IntegerType::getInt8PtrTy(context)),
+      builder.CreateStructGEP(taskType, taskTyped, 0));
+  builder.CreateStore(frame, builder.CreateStructGEP(taskType, taskTyped, 1));
+  for (unsigned i = 0; i < call->getNumArgOperands(); i++)
+    builder.CreateStore(call->getArgOperand(i),
+                        builder.CreateStructGEP(taskType, taskTyped, i + 2));
+  builder.CreateCall(getSpawnFunc(module), task);
+  call->eraseFromParent();
+
+  return extracted;
+}
+
+void seq::tapir::WorkStealingABI::preProcessFunction(Function &F) {}
+
+void seq::tapir::WorkStealingABI::postProcessFunction(Function &F) {
+  // done once all of F's detaches and syncs have been lowered, since it
+  // changes F's CFG
+  auto it = frames.find(&F);
+  if (it == frames.end())
+    return;
+  syncOnUnwind(F, it->second);
+  frames.erase(it);
+}
+
+void seq::tapir::WorkStealingABI::postProcessHelper(Function &F) {}
+
+bool seq::tapir::WorkStealingABI::processMain(Function &F) {
+  return false;
+}
+
+#endif // SEQ_WORK_STEALING
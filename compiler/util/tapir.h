@@ -1,6 +1,7 @@
 #pragma once
 
 #include "util/common.h"
+#include <map>
 
 #if SEQ_HAS_TAPIR
 
@@ -9,6 +10,7 @@
  */
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Tapir/OpenMPABI.h"
+#include "llvm/Transforms/Tapir/TapirUtils.h"
 
 extern llvm::StructType *IdentTy;
 extern llvm::FunctionType *Kmpc_MicroTy;
@@ -27,6 +29,34 @@ extern llvm::cl::opt<bool> fastOpenMP;
 namespace seq {
 namespace tapir {
 void resetOMPABI();
+
+#if SEQ_WORK_STEALING
+/*
+ * Lowers detach/sync to the runtime's work-stealing scheduler (see
+ * runtime/sched.cpp) rather than to OpenMP tasks
+ */
+class WorkStealingABI : public llvm::TapirTarget {
+  // frames of functions whose exits still need an implicit sync
+  std::map<llvm::Function *, llvm::Value *> frames;
+
+  llvm::Value *getOrCreateFrame(llvm::Function &F,
+                                llvm::ValueToValueMapTy &DetachCtxToStackFrame);
+
+public:
+  WorkStealingABI() = default;
+  llvm::Value *GetOrCreateWorker8(llvm::Function &F) override;
+  void createSync(llvm::SyncInst &sync,
+                  llvm::ValueToValueMapTy &DetachCtxToStackFrame) override;
+  llvm::Function *createDetach(llvm::DetachInst &detach,
+                               llvm::ValueToValueMapTy &DetachCtxToStackFrame,
+                               llvm::DominatorTree &DT,
+                               llvm::AssumptionCache &AC) override;
+  void preProcessFunction(llvm::Function &F) override;
+  void postProcessFunction(llvm::Function &F) override;
+  void postProcessHelper(llvm::Function &F) override;
+  bool processMain(llvm::Function &F) override;
+};
+#endif
 } // namespace tapir
 } // namespace seq
 
@@ -264,16 +264,17 @@ struct InterAlignParams {
   int8_t end_bonus;
 };
 
+// Each call aligns its batch on the calling thread (the kernels' own OpenMP
+// regions are disabled), so scratch buffers are sized for a single thread.
+// Parallel pipelines get their throughput by giving each thread its own batch.
+static const int INTER_ALIGN_THREADS = 1;
+
 // Seq entry point:
 SEQ_FUNC void seq_inter_align128(InterAlignParams *paramsx,
                                  SeqPair *seqPairArray, uint8_t *seqBufRef,
                                  uint8_t *seqBufQer, int numPairs) {
   InterAlignParams params = *paramsx;
-#ifdef _OPENMP
-  int numThreads = omp_get_num_threads();
-#else
-  int numThreads = 1;
-#endif
+  const int numThreads = INTER_ALIGN_THREADS;
   int8_t mat[25];
   bwa_fill_scmat(params.a, params.b, params.ambig, mat);
   BandedPairWiseSW bsw(params.gapo, params.gape, params.gapo, params.gape,
@@ -287,11 +288,7 @@ SEQ_FUNC void seq_inter_align16(InterAlignParams *paramsx,
                                 SeqPair *seqPairArray, uint8_t *seqBufRef,
                                 uint8_t *seqBufQer, int numPairs) {
   InterAlignParams params = *paramsx;
-#ifdef _OPENMP
-  int numThreads = omp_get_num_threads();
-#else
-  int numThreads = 1;
-#endif
+  const int numThreads = INTER_ALIGN_THREADS;
   int8_t mat[25];
   bwa_fill_scmat(params.a, params.b, params.ambig, mat);
   BandedPairWiseSW bsw(params.gapo, params.gape, params.gapo, params.gape,
@@ -305,11 +302,7 @@ SEQ_FUNC void seq_inter_align1(InterAlignParams *paramsx, SeqPair *seqPairArray,
                                uint8_t *seqBufRef, uint8_t *seqBufQer,
                                int numPairs) {
   InterAlignParams params = *paramsx;
-#ifdef _OPENMP
-  int numThreads = omp_get_num_threads();
-#else
-  int numThreads = 1;
-#endif
+  const int numThreads = INTER_ALIGN_THREADS;
   int8_t mat[25];
   bwa_fill_scmat(params.a, params.b, params.ambig, mat);
   BandedPairWiseSW bsw(params.gapo, params.gape, params.gapo, params.gape,
@@ -0,0 +1,221 @@
+#include "lib.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <htslib/bgzf.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Threaded BGZF/gzip I/O
+ *
+ * Files are read through htslib's BGZF layer, which also handles plain
+ * gzip and uncompressed files. A BGZF file is a series of independent
+ * deflate blocks, so those are inflated in parallel on htslib's thread pool
+ * with their output kept in order. Plain gzip is a single deflate stream
+ * that can only be inflated sequentially, so it is read ahead on its own
+ * thread into two buffers instead: the caller copies out of one while the
+ * other is being filled.
+ *
+ * Writing produces BGZF (or uncompressed output for mode "wu"), with blocks
+ * deflated in parallel on the thread pool and written out in order.
+ */
+
+namespace {
+const size_t CHUNK_SIZE = 1 << 20;
+
+int defaultThreads() {
+  // a few threads already inflate faster than a parser consumes
+  unsigned n = thread::hardware_concurrency();
+  return n ? (int)min(n, 4u) : 1;
+}
+
+class Stream {
+  struct Chunk {
+    vector<char> data;
+    ssize_t len = 0; // bytes in data; 0 at EOF, negative on error
+    bool full = false;
+  };
+
+  BGZF *fp;
+  bool ahead; // whether the read-ahead thread is used
+  Chunk chunks[2];
+  int cur = 0;    // chunk the caller is reading from
+  size_t pos = 0; // position in chunks[cur]
+  bool stop = false;
+  mutex m;
+  condition_variable cv;
+  thread filler;
+
+  void fill() {
+    for (int i = 0;; i ^= 1) {
+      Chunk &c = chunks[i];
+      {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return !c.full || stop; });
+        if (stop)
+          return;
+      }
+      ssize_t len = bgzf_read(fp, c.data.data(), CHUNK_SIZE);
+      {
+        lock_guard<mutex> lock(m);
+        c.len = len;
+        c.full = true;
+      }
+      cv.notify_all();
+      if (len <= 0)
+        return;
+    }
+  }
+
+public:
+  Stream(BGZF *fp, bool ahead) : fp(fp), ahead(ahead) {
+    if (ahead) {
+      for (auto &c : chunks)
+        c.data.resize(CHUNK_SIZE);
+      filler = thread(&Stream::fill, this);
+    }
+  }
+
+  ~Stream() {
+    if (ahead) {
+      {
+        lock_guard<mutex> lock(m);
+        stop = true;
+      }
+      cv.notify_all();
+      filler.join();
+    }
+  }
+
+  BGZF *file() { return fp; }
+
+  bool readsAhead() const { return ahead; }
+
+  // Reads up to n bytes from the given uncompressed offset, which needs the
+  // .gzi index. Such reads share fp, so concurrent ones are serialized.
+  ssize_t readAt(off_t offset, char *out, size_t n) {
+    if (ahead)
+      return -1;
+    lock_guard<mutex> lock(m);
+    if (bgzf_useek(fp, offset, SEEK_SET) < 0)
+      return -1;
+    size_t done = 0;
+    while (done < n) {
+      ssize_t k = bgzf_read(fp, out + done, n - done);
+      if (k < 0)
+        return -1;
+      if (k == 0)
+        break;
+      done += (size_t)k;
+    }
+    return (ssize_t)done;
+  }
+
+  ssize_t read(char *out, size_t n) {
+    if (!ahead)
+      return bgzf_read(fp, out, n);
+
+    size_t done = 0;
+    while (done < n) {
+      Chunk &c = chunks[cur];
+      {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return c.full; });
+      }
+      // an EOF or error chunk stays full, so later reads see it again
+      if (c.len < 0)
+        return done ? (ssize_t)done : -1;
+      if (c.len == 0)
+        break;
+
+      size_t k = min(n - done, (size_t)c.len - pos);
+      memcpy(out + done, c.data.data() + pos, k);
+      done += k;
+      pos += k;
+      if (pos == (size_t)c.len) {
+        {
+          lock_guard<mutex> lock(m);
+          c.full = false;
+        }
+        cv.notify_all();
+        cur ^= 1;
+        pos = 0;
+      }
+    }
+    return (ssize_t)done;
+  }
+};
+} // namespace
+
+/*
+ * Opens path with the given number of threads, or a default number if
+ * threads <= 0; with one thread, everything runs on the caller's. The mode
+ * is as for bgzf_open(): "r" to read, or "w" with an optional compression
+ * level 0-9 or "u" for uncompressed output. Returns null if the file cannot
+ * be opened.
+ */
+SEQ_FUNC void *seq_bgzf_open(const char *path, const char *mode,
+                             seq_int_t threads) {
+  BGZF *fp = bgzf_open(path, mode);
+  if (!fp)
+    return nullptr;
+  if (threads <= 0)
+    threads = defaultThreads();
+
+  if (fp->is_write) {
+    if (fp->is_compressed && threads > 1)
+      bgzf_mt(fp, (int)threads, 256); // stays single-threaded on failure
+    return new Stream(fp, /*ahead=*/false);
+  }
+
+  // bgzf_compression(): 0 for uncompressed, 1 for gzip, 2 for BGZF
+  const int compression = bgzf_compression(fp);
+  bool ahead = false;
+  if (compression == 2 && threads > 1)
+    ahead = bgzf_mt(fp, (int)threads, 256) != 0; // fall back to read-ahead
+  else
+    ahead = compression != 0 && threads > 1;
+  return new Stream(fp, ahead);
+}
+
+// Returns the number of bytes read, 0 at EOF or -1 on error.
+SEQ_FUNC seq_int_t seq_bgzf_read(void *stream, char *buf, seq_int_t n) {
+  return ((Stream *)stream)->read(buf, (size_t)n);
+}
+
+// Returns the number of bytes written or -1 on error.
+SEQ_FUNC seq_int_t seq_bgzf_write(void *stream, const char *buf,
+                                  seq_int_t n) {
+  return bgzf_write(((Stream *)stream)->file(), buf, (size_t)n);
+}
+
+/*
+ * Loads the .gzi index of a BGZF file opened with one thread, which lets
+ * seq_bgzf_read_at() read from uncompressed offsets. Returns 0 on success.
+ */
+SEQ_FUNC seq_int_t seq_bgzf_load_gzi(void *stream, const char *path) {
+  auto *s = (Stream *)stream;
+  if (s->readsAhead())
+    return -1;
+  return bgzf_index_load(s->file(), path, ".gzi");
+}
+
+// Reads up to n bytes starting at the given uncompressed offset; safe to
+// call from several threads at once. Returns the number of bytes read (less
+// than n only at EOF) or -1 on error.
+SEQ_FUNC seq_int_t seq_bgzf_read_at(void *stream, seq_int_t offset, char *buf,
+                                    seq_int_t n) {
+  return ((Stream *)stream)->readAt((off_t)offset, buf, (size_t)n);
+}
+
+// Flushes any buffered output and closes the file; returns 0 on success.
+SEQ_FUNC seq_int_t seq_bgzf_close(void *stream) {
+  auto *s = (Stream *)stream;
+  BGZF *fp = s->file();
+  delete s; // stops the read-ahead thread before the file is closed
+  return bgzf_close(fp);
+}
@@ -0,0 +1,112 @@
+#include "lib.h"
+#include <cstring>
+#include <memory>
+
+/*
+ * Byte string hashing
+ *
+ * This is wyhash (final version 4), which reads 8 or 16 bytes at a time and
+ * mixes them with 64x64->128-bit multiplies. It is much faster than a
+ * byte-at-a-time loop for all but the shortest strings, and its output is
+ * well distributed in the low bits, which is what the hash tables index by.
+ */
+
+SEQ_FUNC void seq_revcomp(char *out, const char *in, seq_int_t n);
+
+namespace {
+const uint64_t SECRET[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                            0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+inline void mum(uint64_t *a, uint64_t *b) {
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+  mum(&a, &b);
+  return a ^ b;
+}
+
+inline uint64_t r8(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint64_t r4(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// 1-3 bytes
+inline uint64_t r3(const unsigned char *p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+  const unsigned char *p = (const unsigned char *)key;
+  uint64_t a, b;
+  seed ^= mix(seed ^ SECRET[0], SECRET[1]);
+
+  if (len <= 16) {
+    if (len >= 4) {
+      const size_t off = (len >> 3) << 2;
+      a = (r4(p) << 32) | r4(p + off);
+      b = (r4(p + len - 4) << 32) | r4(p + len - 4 - off);
+    } else if (len > 0) {
+      a = r3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = mix(r8(p) ^ SECRET[1], r8(p + 8) ^ seed);
+        see1 = mix(r8(p + 16) ^ SECRET[2], r8(p + 24) ^ see1);
+        see2 = mix(r8(p + 32) ^ SECRET[3], r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = mix(r8(p) ^ SECRET[1], r8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = r8(p + i - 16);
+    b = r8(p + i - 8);
+  }
+
+  a ^= SECRET[1];
+  b ^= seed;
+  mum(&a, &b);
+  return mix(a ^ SECRET[0] ^ len, b ^ SECRET[1]);
+}
+} // namespace
+
+SEQ_FUNC seq_int_t seq_hash_bytes(const char *p, seq_int_t n) {
+  return (seq_int_t)wyhash(p, (size_t)n, 0);
+}
+
+/*
+ * Hash of the reverse complement of p[0..n), equal to seq_hash_bytes() of
+ * the reverse complement itself so that reverse complement views hash the
+ * same as copies of them.
+ */
+SEQ_FUNC seq_int_t seq_hash_revcomp(const char *p, seq_int_t n) {
+  char small[256];
+  std::unique_ptr<char[]> large;
+  char *buf = small;
+  if (n > (seq_int_t)sizeof(small)) {
+    large.reset(new char[n]);
+    buf = large.get();
+  }
+  seq_revcomp(buf, p, n);
+  return seq_hash_bytes(buf, n);
+}
@@ -1,16 +1,22 @@
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <unwind.h>
@@ -235,6 +241,35 @@ SEQ_FUNC void *seq_stdout() { return stdout; }
 
 SEQ_FUNC void *seq_stderr() { return stderr; }
 
+/*
+ * Maps the file at path read-only and stores its size in len; returns null
+ * if the file is empty, or on failure, in which case len is set to -1. The
+ * mapping is not visible to the GC, so it must outlive any pointers into
+ * it, and writing to it crashes the program.
+ */
+SEQ_FUNC void *seq_mmap_file(const char *path, seq_int_t *len) {
+  *len = -1;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  void *p = nullptr;
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    if (st.st_size > 0)
+      p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      p = nullptr;
+    else
+      *len = (seq_int_t)st.st_size;
+  }
+  close(fd);
+  return p;
+}
+
+SEQ_FUNC void seq_munmap_file(void *p, seq_int_t len) {
+  munmap(p, (size_t)len);
+}
+
 /*
  * dlopen
  */
@@ -304,6 +339,342 @@ SEQ_FUNC void seq_rlock_release(void *lock) {
   m->unlock();
 }
 
+/*
+ * Reorder buffer for ordered parallel pipelines
+ *
+ * Tasks deposit items tagged with their sequence numbers. The task that
+ * deposits the next item to be emitted becomes the emitter, and takes
+ * items in order until it reaches one that is not yet available.
+ */
+
+struct seq_reorder_t {
+  void **slots; // buffered items, indexed by sequence number mod capacity
+  seq_int_t cap;
+  atomic<seq_int_t> next; // sequence number of next item to emit
+  bool emitting;          // whether some task is currently emitting
+  mutex m;
+
+  explicit seq_reorder_t(seq_int_t cap)
+      : slots((void **)seq_alloc(cap * sizeof(void *))), cap(cap), next(0),
+        emitting(false), m() {
+    memset(slots, 0, cap * sizeof(void *));
+  }
+};
+
+SEQ_FUNC void *seq_reorder_new(seq_int_t cap) {
+  // allocated through GC (not atomic) so that buffered items stay alive
+  return (void *)new (seq_alloc(sizeof(seq_reorder_t))) seq_reorder_t(cap);
+}
+
+SEQ_FUNC void seq_reorder_wait(void *reorder, seq_int_t seqno) {
+  auto *r = (seq_reorder_t *)reorder;
+  // wait for a free slot, helping with outstanding tasks in the meantime
+  while (seqno - r->next.load() >= r->cap) {
+#if THREADED
+#pragma omp taskyield
+#endif
+    seq_ws_help();
+    this_thread::yield();
+  }
+}
+
+SEQ_FUNC bool seq_reorder_put(void *reorder, seq_int_t seqno, void *item) {
+  auto *r = (seq_reorder_t *)reorder;
+  lock_guard<mutex> guard(r->m);
+  r->slots[seqno % r->cap] = item;
+  if (!r->emitting && seqno == r->next.load()) {
+    r->emitting = true;
+    return true;
+  }
+  return false;
+}
+
+SEQ_FUNC void *seq_reorder_take(void *reorder) {
+  auto *r = (seq_reorder_t *)reorder;
+  lock_guard<mutex> guard(r->m);
+  seq_int_t next = r->next.load();
+  void *item = r->slots[next % r->cap];
+  if (!item) {
+    r->emitting = false;
+    return nullptr;
+  }
+  r->slots[next % r->cap] = nullptr;
+  r->next.store(next + 1);
+  return item;
+}
+
+/*
+ * Pipeline stage threads
+ *
+ * Sections of a pipeline separated by "threaded" stages communicate
+ * through queues generated by the compiler. seq_stage_wait is called while
+ * a queue is full (producer) or empty (consumer), and returns once "word"
+ * (the queue's head or tail) no longer equals "old", or "closed" (if
+ * given) is set. After a short spin, the caller is counted in the queue's
+ * "waiters" and blocks; the other side calls seq_stage_notify after an
+ * update if it sees a nonzero count. Waiters park on one of a fixed set of
+ * condition variables chosen by queue address.
+ */
+
+struct StageParking {
+  mutex m;
+  condition_variable cv;
+};
+
+static const int STAGE_PARKING_SIZE = 64;
+static StageParking stageParking[STAGE_PARKING_SIZE];
+
+static StageParking &stageParkingFor(seq_int_t *waiters) {
+  return stageParking[((uintptr_t)waiters >> 6) % STAGE_PARKING_SIZE];
+}
+
+SEQ_FUNC void seq_stage_wait(seq_int_t *waiters, seq_int_t *word,
+                             seq_int_t old, seq_int_t *closed) {
+  auto ready = [&]() {
+    return __atomic_load_n(word, __ATOMIC_SEQ_CST) != old ||
+           (closed && __atomic_load_n(closed, __ATOMIC_SEQ_CST));
+  };
+
+  // the other side usually catches up quickly
+  for (int i = 0; i < 16; i++) {
+    if (ready())
+      return;
+    this_thread::yield();
+  }
+
+  StageParking &p = stageParkingFor(waiters);
+  unique_lock<mutex> lock(p.m);
+  __atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+  while (!ready())
+    p.cv.wait(lock);
+  __atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+SEQ_FUNC void seq_stage_notify(seq_int_t *waiters) {
+  StageParking &p = stageParkingFor(waiters);
+  lock_guard<mutex> guard(p.m);
+  p.cv.notify_all();
+}
+
+/*
+ * Batch size tuning for parallel pipelines
+ *
+ * Items that enter a parallel section are grouped into batches, each of
+ * which is processed by a single task. Tasks report how long their batch
+ * took, and the batch size is adjusted so that tasks run for roughly
+ * SEQ_BATCH_TARGET_NS, which amortizes spawn overhead for cheap stages
+ * without hurting load balance for expensive ones.
+ */
+
+#define SEQ_BATCH_TARGET_NS 50000
+
+struct seq_batch_t {
+  atomic<seq_int_t> size;
+  seq_int_t max;
+
+  explicit seq_batch_t(seq_int_t max) : size(1), max(max) {}
+};
+
+SEQ_FUNC void *seq_batch_new(seq_int_t max) {
+  return (void *)new (seq_alloc_atomic(sizeof(seq_batch_t))) seq_batch_t(max);
+}
+
+SEQ_FUNC seq_int_t seq_batch_size(void *batch) {
+  auto *b = (seq_batch_t *)batch;
+  return b->size.load(memory_order_relaxed);
+}
+
+SEQ_FUNC seq_int_t seq_batch_time() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+SEQ_FUNC void seq_batch_done(void *batch, seq_int_t start, seq_int_t n) {
+  auto *b = (seq_batch_t *)batch;
+  seq_int_t elapsed = seq_batch_time() - start;
+  seq_int_t perItem = max(elapsed / max(n, (seq_int_t)1), (seq_int_t)1);
+  seq_int_t cur = b->size.load(memory_order_relaxed);
+  // grow at most 2x per batch so a few unusually fast items don't overshoot
+  seq_int_t size = min(SEQ_BATCH_TARGET_NS / perItem, 2 * cur);
+  size = max(min(size, b->max), (seq_int_t)1);
+  if (size != cur)
+    b->size.store(size, memory_order_relaxed);
+}
+
+/*
+ * Prefetch scheduler width tuning
+ *
+ * Each prefetch scheduler has a controller that sets how many coroutines
+ * it keeps in flight. The best width depends on the index, the cache
+ * hierarchy and the work done per lookup, so rather than fixing it at
+ * compile time we hill-climb on measured throughput: every window of
+ * SEQ_SCHED_WINDOW_NS, the width is moved one step in the current
+ * direction, which is reversed whenever throughput drops. The initial
+ * width can be set with SEQ_PREFETCH_WIDTH, and SEQ_PREFETCH_ADAPT=0 keeps
+ * it fixed.
+ */
+
+#define SEQ_SCHED_WINDOW_NS 1000000
+
+// The first two fields are accessed by compiled code, which reserves six
+// words for each controller.
+struct seq_sched_ctl_t {
+  seq_int_t width;     // current width
+  seq_int_t completed; // completions since last seq_sched_tune call
+  seq_int_t items;     // completions in current window
+  seq_int_t start;     // start time of current window
+  seq_int_t rate;      // throughput in previous window (items/sec)
+  seq_int_t dir;       // direction of next step (0 if width is fixed)
+};
+
+static_assert(sizeof(seq_sched_ctl_t) <= 6 * sizeof(seq_int_t),
+              "scheduler controller too large");
+
+SEQ_FUNC void seq_sched_init(seq_int_t *ctl, seq_int_t n, seq_int_t stride,
+                             seq_int_t width, seq_int_t max) {
+  if (const char *s = getenv("SEQ_PREFETCH_WIDTH")) {
+    seq_int_t w = atol(s);
+    if (w > 0)
+      width = w;
+  }
+  width = std::max(std::min(width, max), (seq_int_t)1);
+  const char *adapt = getenv("SEQ_PREFETCH_ADAPT");
+  seq_int_t dir = (adapt && strcmp(adapt, "0") == 0) ? 0 : 1;
+  seq_int_t now = seq_batch_time();
+
+  for (seq_int_t i = 0; i < n; i++) {
+    auto *c = (seq_sched_ctl_t *)&ctl[i * stride];
+    c->width = width;
+    c->completed = 0;
+    c->items = 0;
+    c->start = now;
+    c->rate = 0;
+    c->dir = dir;
+  }
+}
+
+SEQ_FUNC void seq_sched_tune(seq_int_t *ctl, seq_int_t max) {
+  auto *c = (seq_sched_ctl_t *)ctl;
+  c->items += c->completed;
+  c->completed = 0;
+  if (!c->dir)
+    return;
+
+  seq_int_t now = seq_batch_time();
+  seq_int_t elapsed = now - c->start;
+  if (elapsed < SEQ_SCHED_WINDOW_NS)
+    return;
+
+  auto rate = (seq_int_t)(c->items * 1e9 / elapsed);
+  if (rate < c->rate)
+    c->dir = -c->dir;
+  c->rate = rate;
+
+  // steps are proportional to the width so that large widths converge
+  // about as fast as small ones
+  seq_int_t width = c->width + c->dir * std::max(c->width / 8, (seq_int_t)1);
+  if (width < 1 || width > max) {
+    c->dir = -c->dir;
+    width = std::max(std::min(width, max), (seq_int_t)1);
+  }
+  c->width = width;
+  c->items = 0;
+  c->start = now;
+}
+
+/*
+ * Pipeline profiling
+ *
+ * Pipelines compiled with -pipeline-profile register their counters the
+ * first time they run. Counters start with a two-word header (registered
+ * flag, drain cycles), followed by items in, items out and cycles for each
+ * stage. All registered pipelines are reported at exit, as text on stderr
+ * and as JSON in the file named by SEQ_PROFILE_JSON (seq_profile.json by
+ * default).
+ */
+
+struct seq_prof_t {
+  seq_int_t *counters;
+  seq_int_t n;
+  char **names;
+  char *where;
+};
+
+static vector<seq_prof_t> *profs = nullptr;
+static mutex profsLock;
+
+static void seq_prof_write_json_str(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', out);
+    fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+static void seq_prof_report() {
+  lock_guard<mutex> guard(profsLock);
+  const char *path = getenv("SEQ_PROFILE_JSON");
+  FILE *json = fopen(path ? path : "seq_profile.json", "w");
+  if (!json)
+    fprintf(stderr, "warning: could not write pipeline profile JSON\n");
+  else
+    fprintf(json, "[");
+
+  for (size_t i = 0; i < profs->size(); i++) {
+    seq_prof_t &p = (*profs)[i];
+    long long drain = p.counters[1];
+    fprintf(stderr, "pipeline at %s\n", p.where);
+    fprintf(stderr, "  %-4s %-24s %14s %14s %16s %12s\n", "#", "stage", "in",
+            "out", "cycles", "cycles/in");
+    for (seq_int_t j = 0; j < p.n; j++) {
+      seq_int_t *c = &p.counters[2 + 3 * j];
+      long long in = c[0], out = c[1], cycles = c[2];
+      fprintf(stderr, "  %-4lld %-24s %14lld %14lld %16lld %12.1f\n",
+              (long long)j, p.names[j], in, out, cycles,
+              in ? (double)cycles / in : 0.0);
+    }
+    if (drain)
+      fprintf(stderr, "  drain cycles: %lld\n", drain);
+
+    if (!json)
+      continue;
+    fprintf(json, "%s\n  {\"pipeline\": ", i ? "," : "");
+    seq_prof_write_json_str(json, p.where);
+    fprintf(json, ", \"drain_cycles\": %lld, \"stages\": [", drain);
+    for (seq_int_t j = 0; j < p.n; j++) {
+      seq_int_t *c = &p.counters[2 + 3 * j];
+      fprintf(json, "%s\n    {\"name\": ", j ? "," : "");
+      seq_prof_write_json_str(json, p.names[j]);
+      fprintf(json, ", \"in\": %lld, \"out\": %lld, \"cycles\": %lld}",
+              (long long)c[0], (long long)c[1], (long long)c[2]);
+    }
+    fprintf(json, "]}");
+  }
+
+  if (json) {
+    fprintf(json, "\n]\n");
+    fclose(json);
+  }
+}
+
+SEQ_FUNC void seq_prof_register(seq_int_t *counters, seq_int_t n, char **names,
+                                char *where) {
+  // called every time the pipeline runs, so check the flag before locking
+  if (__atomic_load_n(&counters[0], __ATOMIC_ACQUIRE) ||
+      __atomic_exchange_n(&counters[0], 1, __ATOMIC_ACQ_REL))
+    return;
+
+  lock_guard<mutex> guard(profsLock);
+  if (!profs) {
+    profs = new vector<seq_prof_t>();
+    atexit(seq_prof_report);
+  }
+  profs->push_back({counters, n, names, where});
+}
+
 /*
  * Alignment
  *
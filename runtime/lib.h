@@ -53,4 +53,6 @@ SEQ_FUNC seq_str_t seq_str_tuple(seq_str_t *strs, seq_int_t n);
 
 SEQ_FUNC void seq_print(seq_str_t str);
 
+SEQ_FUNC void seq_ws_help();
+
 #endif /* SEQ_LIB_H */
@@ -0,0 +1,174 @@
+#include "lib.h"
+#include <cstring>
+
+#if __AVX2__ || __SSSE3__
+#include <immintrin.h>
+#endif
+
+/*
+ * Reverse complement
+ *
+ * Complements follow the compiler's byte complement table (byte.comp()):
+ * IUPAC codes map to their complements with case preserved, '.' and '-'
+ * map to themselves and anything else maps to 'N'. The vector paths look
+ * the complement up by the low five bits of each letter with two pshufb's,
+ * then reverse the bytes of the block with another.
+ */
+
+namespace {
+const char *const COMP_FROM = "ACBDGHKMNSRUTWVYacbdghkmnsrutwvy.-";
+const char *const COMP_TO = "TGVHCDMKNSYAAWBRtgvhcdmknsyaawbr.-";
+
+struct CompTable {
+  char table[256];
+
+  CompTable() : table() {
+    memset(table, 'N', sizeof(table));
+    for (unsigned i = 0; COMP_FROM[i]; i++)
+      table[(unsigned char)COMP_FROM[i]] = COMP_TO[i];
+  }
+};
+
+const CompTable comp;
+
+inline char compByte(char c) { return comp.table[(unsigned char)c]; }
+
+#if __SSSE3__
+// complement of the uppercase letter with the given low four bits, with
+// bit 4 of the letter clear (TAB_LO) or set (TAB_HI); 0 if not IUPAC
+const char TAB_LO[16] = {0,   'T', 'V', 'G', 'H', 0, 0,   'C',
+                         'D', 0,   0,   'M', 0,   'K', 'N', 0};
+const char TAB_HI[16] = {0,   0,   'Y', 'S', 'A', 'A', 'B', 'W',
+                         0,   'R', 0,   0,   0,   0,   0,   0};
+
+inline __m128i compBlock(__m128i x) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i tabLo = _mm_loadu_si128((const __m128i *)TAB_LO);
+  const __m128i tabHi = _mm_loadu_si128((const __m128i *)TAB_HI);
+  const __m128i b4 = _mm_set1_epi8(0x10);
+  const __m128i lo = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+  const __m128i hi = _mm_cmpeq_epi8(_mm_and_si128(x, b4), b4);
+  __m128i t = _mm_or_si128(_mm_and_si128(hi, _mm_shuffle_epi8(tabHi, lo)),
+                           _mm_andnot_si128(hi, _mm_shuffle_epi8(tabLo, lo)));
+
+  // letters are 0x40-0x7f; keep their case bit
+  const __m128i letter = _mm_cmpeq_epi8(
+      _mm_and_si128(x, _mm_set1_epi8((char)0xc0)), _mm_set1_epi8(0x40));
+  t = _mm_and_si128(t, letter);
+  const __m128i invalid = _mm_cmpeq_epi8(t, zero);
+  t = _mm_or_si128(
+      t, _mm_andnot_si128(invalid, _mm_and_si128(x, _mm_set1_epi8(0x20))));
+
+  // '.' and '-' are kept; everything else becomes 'N'
+  const __m128i keep = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('.')),
+                                    _mm_cmpeq_epi8(x, _mm_set1_epi8('-')));
+  t = _mm_or_si128(t, _mm_and_si128(keep, x));
+  const __m128i none = _mm_cmpeq_epi8(t, zero);
+  return _mm_or_si128(t, _mm_and_si128(none, _mm_set1_epi8('N')));
+}
+
+inline __m128i revcompBlock(__m128i x) {
+  const __m128i rev =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  return _mm_shuffle_epi8(compBlock(x), rev);
+}
+#endif
+
+#if __AVX2__
+inline __m256i compBlock(__m256i x) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i tabLo =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)TAB_LO));
+  const __m256i tabHi =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)TAB_HI));
+  const __m256i b4 = _mm256_set1_epi8(0x10);
+  const __m256i lo = _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+  const __m256i hi = _mm256_cmpeq_epi8(_mm256_and_si256(x, b4), b4);
+  __m256i t = _mm256_blendv_epi8(_mm256_shuffle_epi8(tabLo, lo),
+                                 _mm256_shuffle_epi8(tabHi, lo), hi);
+
+  const __m256i high = _mm256_and_si256(x, _mm256_set1_epi8((char)0xc0));
+  t = _mm256_and_si256(t, _mm256_cmpeq_epi8(high, _mm256_set1_epi8(0x40)));
+  const __m256i invalid = _mm256_cmpeq_epi8(t, zero);
+  const __m256i lower = _mm256_and_si256(x, _mm256_set1_epi8(0x20));
+  t = _mm256_or_si256(t, _mm256_andnot_si256(invalid, lower));
+
+  const __m256i keep =
+      _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('.')),
+                      _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')));
+  t = _mm256_or_si256(t, _mm256_and_si256(keep, x));
+  const __m256i none = _mm256_cmpeq_epi8(t, zero);
+  return _mm256_or_si256(t, _mm256_and_si256(none, _mm256_set1_epi8('N')));
+}
+
+inline __m256i revcompBlock(__m256i x) {
+  // reverse within each 128-bit lane, then swap the lanes
+  const __m256i rev = _mm256_set_epi8(
+      0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5,
+      6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  x = _mm256_shuffle_epi8(compBlock(x), rev);
+  return _mm256_permute4x64_epi64(x, 0x4e);
+}
+#endif
+} // namespace
+
+/*
+ * Writes the reverse complement of in[0..n) to out[0..n). The two buffers
+ * must either be identical (in-place) or not overlap.
+ */
+SEQ_FUNC void seq_revcomp(char *out, const char *in, seq_int_t n) {
+  seq_int_t lo = 0;
+  seq_int_t hi = n;
+
+  if (out == in) {
+    // swap blocks from both ends towards the middle
+#if __AVX2__
+    while (hi - lo >= 64) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(out + lo));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(out + hi - 32));
+      _mm256_storeu_si256((__m256i *)(out + lo), revcompBlock(b));
+      _mm256_storeu_si256((__m256i *)(out + hi - 32), revcompBlock(a));
+      lo += 32;
+      hi -= 32;
+    }
+#endif
+#if __SSSE3__
+    while (hi - lo >= 32) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(out + lo));
+      __m128i b = _mm_loadu_si128((const __m128i *)(out + hi - 16));
+      _mm_storeu_si128((__m128i *)(out + lo), revcompBlock(b));
+      _mm_storeu_si128((__m128i *)(out + hi - 16), revcompBlock(a));
+      lo += 16;
+      hi -= 16;
+    }
+#endif
+    while (hi - lo >= 2) {
+      char a = out[lo];
+      out[lo++] = compByte(out[--hi]);
+      out[hi] = compByte(a);
+    }
+    if (lo < hi)
+      out[lo] = compByte(out[lo]);
+    return;
+  }
+
+  // out[lo..] is the reverse complement of in[..hi)
+#if __AVX2__
+  while (hi >= 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(in + hi - 32));
+    _mm256_storeu_si256((__m256i *)(out + lo), revcompBlock(x));
+    lo += 32;
+    hi -= 32;
+  }
+#endif
+#if __SSSE3__
+  while (hi >= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + hi - 16));
+    _mm_storeu_si128((__m128i *)(out + lo), revcompBlock(x));
+    lo += 16;
+    hi -= 16;
+  }
+#endif
+  while (hi > 0)
+    out[lo++] = compByte(in[--hi]);
+}
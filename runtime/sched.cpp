@@ -0,0 +1,301 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if THREADED
+#define GC_THREADS
+#endif
+
+#include "lib.h"
+#include <gc.h>
+
+using namespace std;
+
+/*
+ * Work-stealing scheduler
+ *
+ * Alternative to OpenMP tasks for parallel pipelines, used when the
+ * compiler is built with SEQ_WORK_STEALING. Each worker owns a Chase-Lev
+ * deque: the owner pushes and pops the tasks it spawns at the bottom,
+ * while idle workers steal the oldest tasks from the top. A sync runs
+ * other tasks until all children of its frame have completed.
+ *
+ * Tasks are GC-allocated by the compiled code and start with a
+ * seq_ws_task_t header; the rest holds the task's captured values. A
+ * frame is just a counter of outstanding children in the spawning
+ * function's stack frame.
+ *
+ * The program's main thread is worker 0. Other threads that are not
+ * workers (e.g. a host program's threads calling exported functions) do
+ * not own a deque: their tasks go to a shared injection queue that workers
+ * take from like any other deque, and they wait for their tasks at a sync
+ * without running other tasks themselves.
+ */
+
+struct seq_ws_task_t {
+  void (*fn)(void *);
+  seq_int_t *frame;
+};
+
+namespace {
+class Deque {
+  struct Array {
+    int64_t size;
+    atomic<void *> *buf;
+
+    explicit Array(int64_t size)
+        : size(size), buf((atomic<void *> *)GC_MALLOC_UNCOLLECTABLE(
+                          size * sizeof(atomic<void *>))) {}
+
+    void *get(int64_t i) {
+      return buf[i & (size - 1)].load(memory_order_relaxed);
+    }
+
+    void put(int64_t i, void *x) {
+      buf[i & (size - 1)].store(x, memory_order_relaxed);
+    }
+
+    Array *grow(int64_t bottom, int64_t top) {
+      auto *a = new Array(2 * size);
+      for (int64_t i = top; i < bottom; i++)
+        a->put(i, get(i));
+      return a;
+    }
+  };
+
+  atomic<int64_t> top;
+  atomic<int64_t> bottom;
+  atomic<Array *> array;
+  vector<Array *> retired; // thieves may still be reading old arrays
+
+public:
+  Deque() : top(0), bottom(0), array(new Array(1024)), retired() {}
+
+  // owner only
+  void push(void *task) {
+    int64_t b = bottom.load(memory_order_relaxed);
+    int64_t t = top.load(memory_order_acquire);
+    Array *a = array.load(memory_order_relaxed);
+    if (b - t > a->size - 1) {
+      retired.push_back(a);
+      a = a->grow(b, t);
+      array.store(a, memory_order_release);
+    }
+    a->put(b, task);
+    atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+  }
+
+  // owner only
+  void *pop() {
+    int64_t b = bottom.load(memory_order_relaxed) - 1;
+    Array *a = array.load(memory_order_relaxed);
+    bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = top.load(memory_order_relaxed);
+
+    if (t > b) {
+      bottom.store(b + 1, memory_order_relaxed);
+      return nullptr;
+    }
+
+    void *task = a->get(b);
+    if (t == b) {
+      // last task: race against thieves
+      if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                       memory_order_relaxed))
+        task = nullptr;
+      bottom.store(b + 1, memory_order_relaxed);
+    }
+    return task;
+  }
+
+  // any thread
+  void *steal() {
+    int64_t t = top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = bottom.load(memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+
+    Array *a = array.load(memory_order_acquire);
+    void *task = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                     memory_order_relaxed))
+      return nullptr;
+    return task;
+  }
+};
+
+// The scheduler is created on first use and never destroyed, since
+// detached workers may still be polling when the program exits.
+struct Scheduler {
+  int numWorkers;
+  vector<unique_ptr<Deque>> deques;
+  Deque injected;    // tasks spawned by non-worker threads
+  mutex injectLock; // serializes pushes to "injected"
+
+  explicit Scheduler(int numWorkers)
+      : numWorkers(numWorkers), deques(), injected(), injectLock() {
+    for (int i = 0; i < numWorkers; i++)
+      deques.emplace_back(new Deque());
+  }
+
+  void inject(void *task) {
+    lock_guard<mutex> guard(injectLock);
+    injected.push(task);
+  }
+};
+
+Scheduler *sched = nullptr;
+once_flag schedInit;
+atomic<bool> schedReady(false);
+
+const int NOT_A_WORKER = -1;
+thread_local int workerId = NOT_A_WORKER;
+
+// runs on the thread that loads the runtime, i.e. the main thread
+struct MainWorker {
+  MainWorker() { workerId = 0; }
+} mainWorker;
+
+int numWorkersFromEnv() {
+  for (const char *var : {"SEQ_NUM_THREADS", "OMP_NUM_THREADS"}) {
+    if (const char *s = getenv(var)) {
+      int n = atoi(s);
+      if (n > 0)
+        return n;
+    }
+  }
+  unsigned n = thread::hardware_concurrency();
+  return n ? (int)n : 1;
+}
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+void runTask(void *task) {
+  auto *t = (seq_ws_task_t *)task;
+  seq_int_t *frame = t->frame;
+  t->fn(task);
+  __atomic_fetch_sub(frame, 1, __ATOMIC_RELEASE);
+}
+
+void *findTask(int id) {
+  if (void *task = sched->deques[id]->pop())
+    return task;
+  if (void *task = sched->injected.steal())
+    return task;
+
+  thread_local minstd_rand rng(id + 1);
+  const int n = sched->numWorkers;
+  for (int i = 0; i < n; i++) {
+    int victim = (int)(rng() % n);
+    if (victim == id)
+      continue;
+    if (void *task = sched->deques[victim]->steal())
+      return task;
+  }
+  return nullptr;
+}
+
+void workerLoop(int id) {
+#if THREADED
+  GC_stack_base sb;
+  GC_get_stack_base(&sb);
+  GC_register_my_thread(&sb);
+#endif
+  workerId = id;
+
+  // back off gradually so idle workers don't compete with serial code
+  unsigned idle = 0;
+  while (true) {
+    if (void *task = findTask(id)) {
+      runTask(task);
+      idle = 0;
+    } else if (++idle < 64) {
+      cpuRelax();
+    } else if (idle < 128) {
+      this_thread::yield();
+    } else {
+      this_thread::sleep_for(chrono::microseconds(50));
+    }
+  }
+}
+
+void initScheduler() {
+  sched = new Scheduler(numWorkersFromEnv());
+  for (int i = 1; i < sched->numWorkers; i++)
+    thread(workerLoop, i).detach();
+  schedReady.store(true, memory_order_release);
+}
+} // namespace
+
+SEQ_FUNC int32_t seq_ws_num_workers() {
+#if THREADED
+  call_once(schedInit, initScheduler);
+  return sched->numWorkers;
+#else
+  return 1;
+#endif
+}
+
+// Non-workers only run tasks themselves if there is no other worker to run
+// them (see seq_ws_spawn), and then use worker 0's per-thread state.
+SEQ_FUNC int32_t seq_ws_worker_id() {
+  return workerId == NOT_A_WORKER ? 0 : workerId;
+}
+
+SEQ_FUNC void seq_ws_spawn(void *task) {
+  auto *t = (seq_ws_task_t *)task;
+  __atomic_fetch_add(t->frame, 1, __ATOMIC_RELAXED);
+#if THREADED
+  call_once(schedInit, initScheduler);
+  if (workerId != NOT_A_WORKER)
+    sched->deques[workerId]->push(task);
+  else if (sched->numWorkers > 1)
+    sched->inject(task);
+  else
+    runTask(task); // only the main thread could run it
+#else
+  runTask(task);
+#endif
+}
+
+SEQ_FUNC void seq_ws_sync(seq_int_t *frame) {
+  if (workerId == NOT_A_WORKER) {
+    unsigned idle = 0;
+    while (__atomic_load_n(frame, __ATOMIC_ACQUIRE) > 0) {
+      if (++idle < 64)
+        cpuRelax();
+      else if (idle < 128)
+        this_thread::yield();
+      else
+        this_thread::sleep_for(chrono::microseconds(50));
+    }
+    return;
+  }
+
+  while (__atomic_load_n(frame, __ATOMIC_ACQUIRE) > 0) {
+    if (void *task = findTask(workerId))
+      runTask(task);
+    else
+      cpuRelax();
+  }
+}
+
+SEQ_FUNC void seq_ws_help() {
+  if (!schedReady.load(memory_order_acquire) || workerId == NOT_A_WORKER)
+    return;
+  if (void *task = findTask(workerId))
+    runTask(task);
+}
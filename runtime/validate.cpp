@@ -0,0 +1,171 @@
+#include "lib.h"
+
+#if __AVX2__ || __SSSE3__
+#include <immintrin.h>
+#endif
+
+/*
+ * Sequence validation
+ *
+ * Each function returns the index of the first byte of p[0..n) that is not
+ * in some class, or n if there is none. Letters (0x40-0x7f) are classified
+ * case-insensitively by looking up their low five bits with two pshufb's,
+ * so the vector paths check 16 or 32 bytes per iteration with no branches
+ * until a mismatch is found.
+ */
+
+namespace {
+// membership of the uppercase letter with the given low four bits, with
+// bit 4 of the letter clear (_LO) or set (_HI)
+const char IUPAC_LO[16] = {0, 1, 1, 1, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0};
+const char IUPAC_HI[16] = {0, 0, 1, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0};
+const char ACGT_LO[16] = {0, 1, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+const char ACGT_HI[16] = {0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+inline bool isLetterIn(const char *lo, const char *hi, unsigned char c) {
+  return (c & 0xc0) == 0x40 && ((c & 0x10) ? hi : lo)[c & 0x0f];
+}
+
+inline bool isIUPAC(unsigned char c) {
+  return isLetterIn(IUPAC_LO, IUPAC_HI, c) || c == '-' || c == '.';
+}
+
+inline bool isACGT(unsigned char c) { return isLetterIn(ACGT_LO, ACGT_HI, c); }
+
+inline bool isQual(unsigned char c) { return 0x21 <= c && c <= 0x7e; }
+
+#if __SSSE3__
+inline __m128i letterIn(const char *tabLo, const char *tabHi, __m128i x) {
+  const __m128i b4 = _mm_set1_epi8(0x10);
+  const __m128i lo = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+  const __m128i hi = _mm_cmpeq_epi8(_mm_and_si128(x, b4), b4);
+  const __m128i inLo =
+      _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)tabLo), lo);
+  const __m128i inHi =
+      _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)tabHi), lo);
+  const __m128i in = _mm_or_si128(_mm_and_si128(hi, inHi),
+                                  _mm_andnot_si128(hi, inLo));
+  const __m128i high = _mm_and_si128(x, _mm_set1_epi8((char)0xc0));
+  const __m128i letter = _mm_cmpeq_epi8(high, _mm_set1_epi8(0x40));
+  return _mm_andnot_si128(_mm_cmpeq_epi8(in, _mm_setzero_si128()), letter);
+}
+
+inline __m128i iupac(__m128i x) {
+  return _mm_or_si128(letterIn(IUPAC_LO, IUPAC_HI, x),
+                      _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('-')),
+                                   _mm_cmpeq_epi8(x, _mm_set1_epi8('.'))));
+}
+
+inline __m128i acgt(__m128i x) { return letterIn(ACGT_LO, ACGT_HI, x); }
+
+inline __m128i qual(__m128i x) {
+  // signed compares, so bytes >= 0x80 are negative and fail the first
+  return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(0x20)),
+                       _mm_cmplt_epi8(x, _mm_set1_epi8(0x7f)));
+}
+#endif
+
+#if __AVX2__
+inline __m256i letterIn(const char *tabLo, const char *tabHi, __m256i x) {
+  const __m256i b4 = _mm256_set1_epi8(0x10);
+  const __m256i lo = _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+  const __m256i hi = _mm256_cmpeq_epi8(_mm256_and_si256(x, b4), b4);
+  const __m128i tLo = _mm_loadu_si128((const __m128i *)tabLo);
+  const __m128i tHi = _mm_loadu_si128((const __m128i *)tabHi);
+  const __m256i inLo =
+      _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(tLo), lo);
+  const __m256i inHi =
+      _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(tHi), lo);
+  const __m256i in = _mm256_blendv_epi8(inLo, inHi, hi);
+  const __m256i high = _mm256_and_si256(x, _mm256_set1_epi8((char)0xc0));
+  const __m256i letter = _mm256_cmpeq_epi8(high, _mm256_set1_epi8(0x40));
+  return _mm256_andnot_si256(_mm256_cmpeq_epi8(in, _mm256_setzero_si256()),
+                             letter);
+}
+
+inline __m256i iupac(__m256i x) {
+  return _mm256_or_si256(
+      letterIn(IUPAC_LO, IUPAC_HI, x),
+      _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')),
+                      _mm256_cmpeq_epi8(x, _mm256_set1_epi8('.'))));
+}
+
+inline __m256i acgt(__m256i x) { return letterIn(ACGT_LO, ACGT_HI, x); }
+
+inline __m256i qual(__m256i x) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(0x20)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), x));
+}
+#endif
+
+// Class has static valid() overloads for a byte and for vectors of bytes
+template <typename Class> seq_int_t findInvalid(const char *p, seq_int_t n) {
+  seq_int_t i = 0;
+#if __AVX2__
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+    auto bad = ~(uint32_t)_mm256_movemask_epi8(Class::valid(x));
+    if (bad)
+      return i + __builtin_ctz(bad);
+  }
+#endif
+#if __SSSE3__
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+    auto bad = ~(uint32_t)_mm_movemask_epi8(Class::valid(x)) & 0xffffu;
+    if (bad)
+      return i + __builtin_ctz(bad);
+  }
+#endif
+  for (; i < n; i++) {
+    if (!Class::valid((unsigned char)p[i]))
+      return i;
+  }
+  return n;
+}
+
+struct IUPAC {
+  static bool valid(unsigned char c) { return isIUPAC(c); }
+#if __SSSE3__
+  static __m128i valid(__m128i x) { return iupac(x); }
+#endif
+#if __AVX2__
+  static __m256i valid(__m256i x) { return iupac(x); }
+#endif
+};
+
+struct ACGT {
+  static bool valid(unsigned char c) { return isACGT(c); }
+#if __SSSE3__
+  static __m128i valid(__m128i x) { return acgt(x); }
+#endif
+#if __AVX2__
+  static __m256i valid(__m256i x) { return acgt(x); }
+#endif
+};
+
+struct Qual {
+  static bool valid(unsigned char c) { return isQual(c); }
+#if __SSSE3__
+  static __m128i valid(__m128i x) { return qual(x); }
+#endif
+#if __AVX2__
+  static __m256i valid(__m256i x) { return qual(x); }
+#endif
+};
+} // namespace
+
+// first byte that is not an IUPAC nucleotide code, '-' or '.'
+SEQ_FUNC seq_int_t seq_find_invalid_nt(const char *p, seq_int_t n) {
+  return findInvalid<IUPAC>(p, n);
+}
+
+// first byte that is not one of ACGTacgt
+SEQ_FUNC seq_int_t seq_find_ambiguous_nt(const char *p, seq_int_t n) {
+  return findInvalid<ACGT>(p, n);
+}
+
+// first byte that is not a printable Phred+33 quality score
+SEQ_FUNC seq_int_t seq_find_invalid_qual(const char *p, seq_int_t n) {
+  return findInvalid<Qual>(p, n);
+}
@@ -206,7 +206,7 @@ INSTANTIATE_TEST_SUITE_P(
                                      "core/formats.seq", "core/generators.seq",
                                      "core/generics.seq", "core/helloworld.seq",
                                      "core/kmers.seq", "core/match.seq",
-                                     "core/proteins.seq",
+                                     "core/packed.seq", "core/proteins.seq",
                                      "core/serialization.seq",
                                      "core/trees.seq"),
                      testing::Values(true, false)),